@@ -0,0 +1,97 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+/* Fork n children that exit right away, one after the other, and report
+ * how long each fork took on average. Before that, keep k files open, so
+ * that LD_PRELOAD=nocache.so tracks them, and start t threads that open and
+ * close the file in a loop, so that fork() races with the fd table.
+ * usage: forkstorm [-n forks] [-k open files] [-t threads] file */
+
+static const char *file;
+static volatile int done;
+
+static void *opener(void *unused)
+{
+    int fd;
+
+    while(!done)
+        if((fd = open(file, O_RDONLY)) != -1)
+            close(fd);
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    int i, opt, status, forks = 1000, nr_files = 0, nr_threads = 0;
+    pid_t pid;
+    pthread_t *threads;
+    struct timespec start, end;
+    double secs;
+
+    while((opt = getopt(argc, argv, "n:k:t:")) != -1) {
+        switch(opt) {
+        case 'n': forks = atoi(optarg); break;
+        case 'k': nr_files = atoi(optarg); break;
+        case 't': nr_threads = atoi(optarg); break;
+        default: goto usage;
+        }
+    }
+    if(optind != argc - 1 || forks <= 0 || nr_files < 0 || nr_threads < 0)
+        goto usage;
+    file = argv[optind];
+
+    for(i = 0; i < nr_files; i++)
+        if(open(file, O_RDONLY) == -1) {
+            perror(file);
+            return EXIT_FAILURE;
+        }
+    if((threads = calloc(nr_threads + 1, sizeof(*threads))) == NULL) {
+        perror("calloc");
+        return EXIT_FAILURE;
+    }
+    for(i = 0; i < nr_threads; i++)
+        if(pthread_create(&threads[i], NULL, opener, NULL) != 0) {
+            perror("pthread_create");
+            return EXIT_FAILURE;
+        }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(i = 0; i < forks; i++) {
+        if((pid = fork()) == -1) {
+            perror("fork");
+            return EXIT_FAILURE;
+        }
+        if(pid == 0)
+            _exit(0);
+        if(waitpid(pid, &status, 0) == -1 || !WIFEXITED(status)) {
+            fprintf(stderr, "child failed\n");
+            return EXIT_FAILURE;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    done = 1;
+    for(i = 0; i < nr_threads; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+
+    secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("forks=%d open_files=%d threads=%d seconds=%.6f "
+        "usec_per_fork=%.1f\n", forks, nr_files, nr_threads, secs,
+        secs * 1e6 / forks);
+    return EXIT_SUCCESS;
+
+    usage:
+    fprintf(stderr, "usage: %s [-n forks] [-k open files] [-t threads] "
+        "file\n", argv[0]);
+    return EXIT_FAILURE;
+}
+
+/* vim:set et sw=4 ts=4: */
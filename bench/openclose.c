@@ -0,0 +1,128 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+/* Open and close a file in a tight loop from a number of threads, cycling
+ * through all of the calls nocache hooks. Used as a stress test and to
+ * measure per-call overhead, with and without LD_PRELOAD=nocache.so. With
+ * -k, the file is kept open on another fd all along, as by programs that
+ * open the same file more than once. */
+
+static const char *fn;
+static int iterations = 10000;
+static int do_read, keep_open;
+static int failed;
+
+static void *worker(void *arg)
+{
+    int i, fd, fd2;
+    char c;
+    FILE *fp;
+
+    for(i = 0; i < iterations; i++) {
+        switch(i % 4) {
+        case 0:
+        case 1:
+            if((fd = open(fn, O_RDONLY)) == -1)
+                goto err;
+            if(do_read && read(fd, &c, 1) == -1)
+                goto err;
+            if(close(fd) == -1)
+                goto err;
+            break;
+        case 2:
+            if((fd = open(fn, O_RDONLY)) == -1)
+                goto err;
+            if((fd2 = dup(fd)) == -1)
+                goto err;
+            if(close(fd) == -1 || close(fd2) == -1)
+                goto err;
+            break;
+        case 3:
+            if((fp = fopen(fn, "r")) == NULL)
+                goto err;
+            if(do_read && fgetc(fp) == EOF && ferror(fp))
+                goto err;
+            if(fclose(fp) == EOF)
+                goto err;
+            break;
+        }
+    }
+    return NULL;
+
+    err:
+    perror(fn);
+    __atomic_store_n(&failed, 1, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    int i, opt;
+    int nr_threads = 1;
+    pthread_t *threads;
+    struct timespec start, end;
+    double secs;
+
+    while((opt = getopt(argc, argv, "t:n:rk")) != -1) {
+        switch(opt) {
+        case 't': nr_threads = atoi(optarg); break;
+        case 'n': iterations = atoi(optarg); break;
+        case 'r': do_read = 1; break;
+        case 'k': keep_open = 1; break;
+        default: goto usage;
+        }
+    }
+    if(optind != argc - 1 || nr_threads <= 0 || iterations <= 0)
+        goto usage;
+    fn = argv[optind];
+    if(keep_open && open(fn, O_RDONLY) == -1) {
+        perror(fn);
+        return EXIT_FAILURE;
+    }
+
+    threads = calloc(nr_threads, sizeof(*threads));
+    if(!threads) {
+        perror("calloc");
+        return EXIT_FAILURE;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if(nr_threads == 1) {
+        /* stay in the main thread, so bench/syscount can follow us */
+        worker(NULL);
+    } else {
+        for(i = 0; i < nr_threads; i++)
+            if(pthread_create(&threads[i], NULL, worker, NULL) != 0) {
+                perror("pthread_create");
+                return EXIT_FAILURE;
+            }
+        for(i = 0; i < nr_threads; i++)
+            pthread_join(threads[i], NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("threads=%d iterations=%d seconds=%.6f opens_per_sec=%.0f\n",
+        nr_threads, iterations, secs,
+        secs > 0 ? nr_threads * (double)iterations / secs : 0);
+
+    free(threads);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+
+    usage:
+    fprintf(stderr, "usage: %s [-t <threads>] [-n <iterations>] [-r] [-k] "
+        "<file> -- open and close <file> in a loop\n", argv[0]);
+    fprintf(stderr, "\t-r\tread one byte after each open\n");
+    fprintf(stderr, "\t-k\tkeep <file> open on another fd meanwhile\n");
+    return EXIT_FAILURE;
+}
+
+/* vim:set et sw=4 ts=4: */
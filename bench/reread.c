@@ -0,0 +1,112 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+/* Read a set of files from start to end, r times over, opening and closing
+ * each one every time, as a job that scans its working set more than once
+ * does. Report how long each pass took. With -c, run a shell command
+ * before exiting, e.g. to check what LD_PRELOAD=nocache.so has left in the
+ * cache while it still tracks the files, and exit with its status. With -m,
+ * also map [offset, offset+len) of each file and keep it mapped until exit,
+ * so that closing the file can't drop those pages; -m can be given up to
+ * MAX_MAPS times. With -d, read every other block through a duplicate of
+ * the fd made with fcntl(F_DUPFD), which shares its file position.
+ * usage: reread [-r passes] [-c command] [-m offset,len]... [-d] file... */
+
+#define MAX_MAPS 8
+
+static char buf[1 << 16];
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+    int i, opt, fd, pass, passes = 1, dup = 0, fds[2];
+    const char *cmd = NULL;
+    int j, nr_maps = 0;
+    off_t map_off[MAX_MAPS];
+    size_t map_len[MAX_MAPS], off;
+    volatile char *map;
+    char *end;
+    ssize_t n, nr_reads;
+    double start;
+
+    while((opt = getopt(argc, argv, "r:c:m:d")) != -1) {
+        switch(opt) {
+        case 'r': passes = atoi(optarg); break;
+        case 'c': cmd = optarg; break;
+        case 'd': dup = 1; break;
+        case 'm':
+            if(nr_maps == MAX_MAPS)
+                goto usage;
+            map_off[nr_maps] = strtoull(optarg, &end, 10);
+            if(*end != ',')
+                goto usage;
+            map_len[nr_maps++] = strtoul(end + 1, NULL, 10);
+            break;
+        default: goto usage;
+        }
+    }
+    if(optind == argc || passes <= 0)
+        goto usage;
+
+    for(pass = 1; pass <= passes; pass++) {
+        start = now();
+        for(i = optind; i < argc; i++) {
+            if((fd = open(argv[i], O_RDONLY)) == -1) {
+                perror(argv[i]);
+                return EXIT_FAILURE;
+            }
+            for(j = 0; j < nr_maps; j++) {
+                map = mmap(NULL, map_len[j], PROT_READ, MAP_SHARED, fd,
+                    map_off[j]);
+                if(map == MAP_FAILED) {
+                    perror(argv[i]);
+                    return EXIT_FAILURE;
+                }
+                for(off = 0; off < map_len[j]; off += getpagesize())
+                    (void)map[off];
+            }
+            fds[0] = fds[1] = fd;
+            if(dup && (fds[1] = fcntl(fd, F_DUPFD, 0)) == -1) {
+                perror(argv[i]);
+                return EXIT_FAILURE;
+            }
+            for(nr_reads = 0;
+                    (n = read(fds[nr_reads % 2], buf, sizeof(buf))) > 0;
+                    nr_reads++)
+                ;
+            if(n == -1) {
+                perror(argv[i]);
+                return EXIT_FAILURE;
+            }
+            if(dup)
+                close(fds[1]);
+            close(fd);
+        }
+        if(cmd == NULL)
+            printf("pass=%d seconds=%.6f\n", pass, now() - start);
+    }
+
+    if(cmd == NULL)
+        return EXIT_SUCCESS;
+    return system(cmd) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+
+    usage:
+    fprintf(stderr, "usage: %s [-r passes] [-c command] [-m offset,len]... "
+        "[-d] file...\n", argv[0]);
+    return EXIT_FAILURE;
+}
+
+/* vim:set et sw=4 ts=4: */
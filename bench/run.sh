@@ -0,0 +1,126 @@
+#!/bin/sh
+# Run all benchmarks. Every result is printed as one line of key=value
+# pairs, starting with bench=<name>, so runs can be compared with grep/awk.
+# usage: run.sh [quick]
+
+cd "$(dirname "$0")"
+
+F=testfile.$$
+T=testtree.$$
+PRELOADS="none nocache.so"
+N=20000
+SIZES="16 256 4096"
+[ "$1" = quick ] && N=2000 SIZES="16 256"
+
+trap 'rm -rf $F $T $T.copy' EXIT
+echo test > $F
+
+lib() {
+    [ $1 = none ] || echo ../$1
+}
+
+# open/close pairs per second, single- and multithreaded
+for preload in $PRELOADS; do
+    for threads in 1 2 4 8 16; do
+        env LD_PRELOAD=$(lib $preload) ./openclose -t $threads -n $N -r $F |
+            sed "s/^/bench=openclose preload=$preload /"
+    done
+done
+
+# the same, while the file is kept open on another fd
+for preload in $PRELOADS; do
+    for threads in 1 4; do
+        env LD_PRELOAD=$(lib $preload) ./openclose -k -t $threads -n $N -r $F |
+            sed "s/^/bench=openclose_shared preload=$preload /"
+    done
+done
+
+# syscalls per open/close pair
+./syscalls.sh 1000 | sed 's/^/bench=syscalls /'
+
+# fd_get_pageinfo vs. file size and fragmentation, with cachestat() (where
+# the kernel has it) and with mincore() only
+for mb in $SIZES; do
+    rm -f $F
+    truncate -s ${mb}M $F
+    for frag in 0 2 16; do
+        ./scan -n 3 -f $frag $F | sed 's/^/bench=scan /'
+        ./scan -m -n 3 -f $frag $F | sed 's/^/bench=scan /'
+    done
+    # a fully cached file takes that much memory
+    [ $mb -le 256 ] || continue
+    ./scan -n 3 -c $F | sed 's/^/bench=scan /'
+    ./scan -m -n 3 -c $F | sed 's/^/bench=scan /'
+done
+
+# startup/exit cost of a short-lived process, by NOCACHE_MAX_FDS
+./spawn -n 200 true | sed 's/^/bench=spawn preload=none max_fds=- /'
+for max_fds in 16 1024 65536 1048576; do
+    env NOCACHE_MAX_FDS=$max_fds LD_PRELOAD=../nocache.so ./spawn -n 200 true |
+        sed "s/^/bench=spawn preload=nocache.so max_fds=$max_fds /"
+done
+
+# cost of fork() in a process that tracks 0 or 1000 files, by
+# NOCACHE_MAX_FDS, with and without threads opening files meanwhile
+for k in 0 1000; do
+    for t in 0 4; do
+        ./forkstorm -n 500 -k $k -t $t $F |
+            sed 's/^/bench=forkstorm preload=none max_fds=- /'
+        for max_fds in 1024 1048576; do
+            env NOCACHE_MAX_FDS=$max_fds LD_PRELOAD=../nocache.so \
+                ./forkstorm -n 500 -k $k -t $t $F |
+                sed "s/^/bench=forkstorm preload=nocache.so max_fds=$max_fds /"
+        done
+    done
+done
+
+# copy a tree and see how much of the copy ends up in the page cache
+pages() {
+    find "$2" -type f -exec ../cachestats {} \; |
+        awk -v n=$1 '{ split($4, p, "/"); c += p[1]; t += p[2] }
+            END { printf "%s_cached_pages=%d %s_total_pages=%d", n, c, n, t }'
+}
+mkdir -p $T
+for i in $(seq 64); do
+    dd if=/dev/urandom of=$T/$i bs=64k count=16 2>/dev/null
+done
+sync
+for preload in $PRELOADS; do
+    rm -rf $T.copy
+    find $T -type f -exec ../cachedel {} \;
+    start=$(date +%s.%N)
+    env LD_PRELOAD=$(lib $preload) cp -r $T $T.copy
+    end=$(date +%s.%N)
+    echo "bench=cp preload=$preload" \
+        "seconds=$(awk "BEGIN { printf \"%.6f\", $end - $start }")" \
+        "$(pages source $T) $(pages copy $T.copy)"
+done
+
+# 8 processes reading the same files at the same time, with and without a
+# registry shared by the process tree
+for shared in no yes; do
+    find $T -type f -exec ../cachedel {} \;
+    opt=
+    [ $shared = yes ] && opt=-S
+    kb=$(awk '/^pgpgin /{ print $2 }' /proc/vmstat)
+    start=$(date +%s.%N)
+    scans=$(../nocache $opt -s sh -c "for i in 1 2 3 4 5 6 7 8; do
+            cat $T/* $T/* >/dev/null & done; wait" 2>&1 |
+        awk '/mincore_calls|cachestat_calls/ { n += $3 } END { print n }')
+    end=$(date +%s.%N)
+    echo "bench=tree shared=$shared" \
+        "seconds=$(awk "BEGIN { printf \"%.6f\", $end - $start }")" \
+        "scans=$scans" \
+        "read_kb=$(awk -v kb=$kb '/^pgpgin /{ print $2 - kb }' /proc/vmstat)"
+done
+
+# a working set read three times over, with no budget, one that holds half
+# of it and one that holds all of it
+for budget in 0 32M 128M; do
+    find $T -type f -exec ../cachedel {} \;
+    kb=$(awk '/^pgpgin /{ print $2 }' /proc/vmstat)
+    env NOCACHE_BUDGET=$budget LD_PRELOAD=../nocache.so ./reread -r 3 $T/* |
+        sed "s/^/bench=reread budget=$budget /"
+    echo "bench=reread budget=$budget" \
+        "read_kb=$(awk -v kb=$kb '/^pgpgin /{ print $2 - kb }' /proc/vmstat)"
+done
@@ -0,0 +1,112 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <malloc.h>
+
+#include "../pageinfo.h"
+#include "../residency.h"
+
+/* Time fd_get_pageinfo() on a file and report how much the peak RSS grew
+ * while doing so and how much heap its list of uncached ranges takes, for
+ * a given scan window. With -f k, the file is first dropped from the cache
+ * and then every k-th page is read, to measure a fragmented file; with -c
+ * it is read completely. -m scans with mincore() only, not cachestat().
+ * usage: scan [-m] [-w window] [-n repetitions] [-f k | -c] file */
+
+FILE *debugfp;
+
+/* Leave only every k-th page of the file in the cache. */
+static int fragment(int fd, int k)
+{
+    off_t pos, size;
+    char c;
+    int PAGESIZE = getpagesize();
+
+    if((size = lseek(fd, 0, SEEK_END)) == -1)
+        return -1;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    /* no readahead, or neighbouring pages would be cached, too */
+    posix_fadvise(fd, 0, 0, POSIX_FADV_RANDOM);
+    for(pos = 0; pos < size; pos += (off_t)k * PAGESIZE)
+        if(pread(fd, &c, 1, pos) != 1)
+            return -1;
+    return 0;
+}
+
+static long maxrss_kb(void)
+{
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_maxrss;
+}
+
+int main(int argc, char *argv[])
+{
+    int i, opt, fd, reps = 1, frag = 0, cached = 0;
+    char buf[65536];
+    long rss;
+    size_t ranges;
+    struct timespec t0, t1;
+    struct file_pageinfo pi;
+    struct mallinfo2 before, after;
+
+    while((opt = getopt(argc, argv, "mw:n:f:c")) != -1) {
+        switch(opt) {
+        case 'w': pageinfo_scan_window = strtoull(optarg, NULL, 10); break;
+        case 'n': reps = atoi(optarg); break;
+        case 'f': frag = atoi(optarg); break;
+        case 'c': cached = 1; break;
+        case 'm': residency_cachestat = 0; break;
+        default: goto usage;
+        }
+    }
+    if(optind != argc - 1 || reps <= 0)
+        goto usage;
+
+    if((fd = open(argv[optind], O_RDONLY)) == -1) {
+        perror("open");
+        return EXIT_FAILURE;
+    }
+    if(frag > 0 && fragment(fd, frag) == -1) {
+        perror("fragment");
+        return EXIT_FAILURE;
+    }
+    while(cached && read(fd, buf, sizeof(buf)) > 0)
+        ;
+
+    rss = maxrss_kb();
+    before = mallinfo2();
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for(i = 0; i < reps; i++) {
+        pi.fd = fd;
+        if(fd_get_pageinfo(fd, &pi) == NULL) {
+            fprintf(stderr, "fd_get_pageinfo failed\n");
+            return EXIT_FAILURE;
+        }
+        ranges = pi.nr_unmapped;
+        if(i == 0)
+            after = mallinfo2();
+        free_pageinfo(&pi);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    printf("backend=%s size=%lld window=%zu fragment=%d cached=%d ranges=%zu "
+        "range_heap_bytes=%zu usec_per_scan=%.1f maxrss_growth_kb=%ld\n",
+        residency_cachestat ? "cachestat" : "mincore", (long long)pi.size,
+        pageinfo_scan_window, frag, cached, ranges,
+        (after.uordblks + after.hblkhd) - (before.uordblks + before.hblkhd),
+        ((t1.tv_sec - t0.tv_sec) * 1e6 + (t1.tv_nsec - t0.tv_nsec) / 1e3) / reps,
+        maxrss_kb() - rss);
+    return EXIT_SUCCESS;
+
+    usage:
+    fprintf(stderr, "usage: %s [-m] [-w window] [-n repetitions] [-f k | -c] "
+        "file\n", argv[0]);
+    return EXIT_FAILURE;
+}
@@ -0,0 +1,20 @@
+#!/bin/sh
+# Report time and peak memory of a residency scan (fd_get_pageinfo) for a
+# few file sizes and scan windows. The files are sparse, so this needs
+# hardly any disk space.
+# usage: scan.sh [sizes-in-MB...]
+
+cd "$(dirname "$0")"
+
+F=testfile.$$
+SIZES=${*:-"16 1024 16384 262144"}
+
+for mb in $SIZES; do
+    rm -f $F
+    truncate -s ${mb}M $F || break
+    for window in 1048576 16777216 268435456 0; do
+        ./scan -n 3 -w $window $F
+    done
+done
+
+rm -f $F
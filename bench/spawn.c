@@ -0,0 +1,58 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <spawn.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+/* Run a command n times in a row and report how long each run took on
+ * average. Used to measure what LD_PRELOAD=nocache.so adds to the startup
+ * and exit of short-lived processes.
+ * usage: spawn [-n runs] command [argument...] */
+
+extern char **environ;
+
+int main(int argc, char *argv[])
+{
+    int i, opt, status, runs = 100;
+    pid_t pid;
+    struct timespec start, end;
+    double secs;
+
+    while((opt = getopt(argc, argv, "+n:")) != -1) {
+        switch(opt) {
+        case 'n': runs = atoi(optarg); break;
+        default: goto usage;
+        }
+    }
+    if(optind >= argc || runs <= 0)
+        goto usage;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(i = 0; i < runs; i++) {
+        if(posix_spawnp(&pid, argv[optind], NULL, NULL, argv + optind,
+                    environ) != 0) {
+            perror("posix_spawnp");
+            return EXIT_FAILURE;
+        }
+        if(waitpid(pid, &status, 0) == -1 || !WIFEXITED(status)
+                || WEXITSTATUS(status) != 0) {
+            fprintf(stderr, "%s failed\n", argv[optind]);
+            return EXIT_FAILURE;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("runs=%d seconds=%.6f usec_per_run=%.1f\n",
+        runs, secs, secs * 1e6 / runs);
+    return EXIT_SUCCESS;
+
+    usage:
+    fprintf(stderr, "usage: %s [-n runs] command [argument...]\n", argv[0]);
+    return EXIT_FAILURE;
+}
+
+/* vim:set et sw=4 ts=4: */
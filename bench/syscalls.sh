@@ -0,0 +1,28 @@
+#!/bin/sh
+# Print the number of system calls one iteration of bench/openclose (an
+# open/close pair, including dup and fopen variants) costs, with and without
+# nocache.so preloaded.
+# usage: syscalls.sh [iterations]
+
+cd "$(dirname "$0")"
+
+N=${1:-1000}
+F=testfile.$$
+echo test > $F
+
+count() {
+    n=$1; shift
+    env "$@" ./syscount ./openclose -n $n -r $F | sed -n 's/^syscalls=//p'
+}
+
+for preload in none nocache.so; do
+    lib=
+    [ $preload != none ] && lib=../$preload
+    first=$(count 1 LD_PRELOAD=$lib)
+    all=$(count $N LD_PRELOAD=$lib)
+    awk -v p=$preload -v n=$N -v a=$first -v b=$all 'BEGIN {
+        printf "preload=%s iterations=%d syscalls_per_iteration=%.2f\n",
+            p, n, (b - a) / (n - 1) }'
+done
+
+rm -f $F
@@ -0,0 +1,66 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/ptrace.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+/* Run a command under ptrace and count the system calls it makes. Only the
+ * initial thread of the command is traced, which is all we need to compare
+ * the cost of single-threaded hooked calls with and without nocache.so. */
+
+int main(int argc, char *argv[])
+{
+    pid_t pid;
+    int status;
+    long stops = 0;
+
+    if(argc < 2) {
+        fprintf(stderr, "usage: %s <command> [argument...] "
+            "-- count system calls made by command\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if((pid = fork()) == -1) {
+        perror("fork");
+        return EXIT_FAILURE;
+    }
+    if(pid == 0) {
+        ptrace(PTRACE_TRACEME, 0, NULL, NULL);
+        execvp(argv[1], argv + 1);
+        perror(argv[1]);
+        _exit(127);
+    }
+
+    /* stopped at execve() */
+    if(waitpid(pid, &status, 0) == -1 || !WIFSTOPPED(status)) {
+        fprintf(stderr, "%s: could not trace child\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    ptrace(PTRACE_SETOPTIONS, pid, NULL,
+        PTRACE_O_TRACESYSGOOD | PTRACE_O_EXITKILL);
+
+    for(;;) {
+        if(ptrace(PTRACE_SYSCALL, pid, NULL, NULL) == -1) {
+            perror("ptrace");
+            return EXIT_FAILURE;
+        }
+        if(waitpid(pid, &status, 0) == -1) {
+            perror("waitpid");
+            return EXIT_FAILURE;
+        }
+        if(WIFEXITED(status) || WIFSIGNALED(status))
+            break;
+        if(WIFSTOPPED(status) && WSTOPSIG(status) == (SIGTRAP | 0x80))
+            stops++;
+    }
+
+    /* every system call stops twice: on entry and on exit (exit_group(),
+     * which never returns, is rounded away) */
+    printf("syscalls=%ld\n", stops / 2);
+    return WIFEXITED(status) ? WEXITSTATUS(status) : EXIT_FAILURE;
+}
+
+/* vim:set et sw=4 ts=4: */
@@ -1,10 +1,23 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
-#include <error.h>
+#include <getopt.h>
+#include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "policy.h"
+#include "residency.h"
+#include "snapshot.h"
+#include "walk.h"
+
+static int n = 1, verbose;
+static off_t offset, length;
+static struct snapshot *snapshot;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
 
 int exiterr(const char *s)
 {
@@ -12,42 +25,137 @@ int exiterr(const char *s)
     exit(-1);
 }
 
-int main(int argc, char *argv[])
+/* up to n passes, each retrying what the one before left cached */
+static int fadvise(int fd, off_t off, off_t len)
 {
-    int i, n = 1;
-    int fd;
-    char *fn;
-    struct stat st;
+    struct evict_stats es;
 
-    if(argc == 4 && !strcmp("-n", argv[1])) {
-            n = atoi(argv[2]);
-            fn = argv[3];
-    } else if(argc != 2) {
-        fprintf(stderr, "usage: %s [-n <n>] <file> "
-            "-- call fadvise(DONTNEED) <n> times on file\n", argv[0]);
-        exit(1);
-    } else {
-        fn = argv[1];
+    return fd_evict_range(fd, off, len, n, &es);
+}
+
+/* Drop the pages of [offset, offset+length) that were not cached when the
+ * snapshot was taken, i.e. the gaps between its runs; all of them if the
+ * file is not in the snapshot. A file whose size or modification time
+ * differs from the snapshot's (or another file that got its inode number)
+ * counts as not in it, as with cachesnap restore. */
+static int fadvise_outside_snapshot(int fd, const struct stat *st)
+{
+    const struct snapshot_entry *e;
+    struct snapshot_runs it;
+    uint64_t start, len;
+    off_t pos = offset, end, run_start, run_end;
+    int ret;
+
+    end = length ? offset + length : st->st_size;
+    e = snapshot_find_inode(snapshot, st->st_dev, st->st_ino);
+    if(e && (st->st_size != (off_t)e->rec.size ||
+                st->st_mtim.tv_sec != e->rec.mtime_sec ||
+                st->st_mtim.tv_nsec != e->rec.mtime_nsec))
+        e = NULL;
+    if(e) {
+        snapshot_runs_init(&it, e);
+        while(pos < end && snapshot_next_run(&it, &start, &len)) {
+            run_start = start * snapshot->page_size;
+            run_end = (start + len) * snapshot->page_size;
+            if(run_end <= pos)
+                continue;
+            if(run_start > pos &&
+                    (ret = fadvise(fd, pos, (run_start < end ? run_start : end)
+                        - pos)) != 0)
+                return ret;
+            pos = run_end;
+        }
     }
+    if(pos < end)
+        return fadvise(fd, pos, length ? end - pos : 0);
+    return 0;
+}
+
+static int evict_file(const char *path, void *dir, void *arg)
+{
+    int fd, ret;
+    struct stat st;
+    size_t before = 0, after = 0;
 
-    fd = open(fn, O_RDONLY);
-    if(fd == -1)
-        exiterr("open");
+    if((fd = open(path, O_RDONLY)) == -1 || fstat(fd, &st) == -1)
+        goto error;
+    if(verbose && fd_count_resident(fd, offset, length, &before) == -1)
+        goto error;
 
-    if(fstat(fd, &st) == -1)
-        exiterr("fstat");
-    if(!S_ISREG(st.st_mode)) {
-        fprintf(stderr, "%s: S_ISREG: not a regular file", fn);
-        return EXIT_FAILURE;
+    if(snapshot)
+        ret = fadvise_outside_snapshot(fd, &st);
+    else
+        ret = fadvise(fd, offset, length);
+    if(ret != 0) {
+        errno = ret;
+        goto error;
     }
-    if(st.st_size == 0) {
-        fprintf(stderr, "%s: file size is 0!\n", fn);
-        return EXIT_FAILURE;
+
+    if(verbose) {
+        if(fd_count_resident(fd, offset, length, &after) == -1)
+            goto error;
+        pthread_mutex_lock(&lock);
+        printf("pages freed: %zu/%zu (%zu still cached)  %s\n",
+            before > after ? before - after : 0, before, after, path);
+        pthread_mutex_unlock(&lock);
     }
+    close(fd);
+    return 0;
+
+error:
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    if(fd != -1)
+        close(fd);
+    return -1;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-v] [-n <n>] [-j threads] [-o offset] "
+        "[-l length] [-s snapshot] <path>... "
+        "-- call fadvise(DONTNEED) up to <n> times on files\n", name);
+    fprintf(stderr, "\t-v, --verbose\t\tprint pages freed per file\n");
+    fprintf(stderr, "\t-j, --jobs n\t\tevict with n threads (default: one "
+        "per CPU)\n");
+    fprintf(stderr, "\t-o, --offset bytes\tstart of the range to evict\n");
+    fprintf(stderr, "\t-l, --length bytes\tlength of the range to evict "
+        "(default: up to EOF)\n");
+    fprintf(stderr, "\t-s, --snapshot file\tkeep pages that were cached in "
+        "a snapshot taken with `cachesnap save`\n");
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    int opt, nr_threads = 0;
+    static const struct option options[] = {
+        { "verbose", no_argument, NULL, 'v' },
+        { "jobs", required_argument, NULL, 'j' },
+        { "offset", required_argument, NULL, 'o' },
+        { "length", required_argument, NULL, 'l' },
+        { "snapshot", required_argument, NULL, 's' },
+        { NULL, 0, NULL, 0 }
+    };
+    struct walk_ops ops = { NULL, evict_file, NULL };
 
-    for(i = 0; i < n; i++)
-        if(posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED) == -1)
-            exiterr("posix_fadvise");
+    while((opt = getopt_long(argc, argv, "vn:j:o:l:s:", options, NULL)) != -1) {
+        switch(opt) {
+        case 'v': verbose = 1; break;
+        case 'n': n = atoi(optarg); break;
+        case 'j': nr_threads = atoi(optarg); break;
+        case 'o': offset = parse_size(optarg); break;
+        case 'l': length = parse_size(optarg); break;
+        case 's':
+            if((snapshot = snapshot_load(optarg)) == NULL)
+                exiterr(optarg);
+            break;
+        default: usage(argv[0]);
+        }
+    }
+    if(optind == argc || nr_threads < 0)
+        usage(argv[0]);
 
+    if(walk_paths(argv + optind, argc - optind, nr_threads, &ops))
+        return EXIT_FAILURE;
     return EXIT_SUCCESS;
 }
@@ -0,0 +1,246 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "snapshot.h"
+#include "walk.h"
+
+/* restore reads ahead in chunks of this many bytes */
+#define CHUNK_SIZE (1024 * 1024)
+
+struct chunk {
+    off_t offset, len;
+};
+
+static struct snapshot *snapshot;
+static size_t next_entry, restored, changed;
+static int depth = 16, force, size_only, errors;
+
+static int save_file(const char *path, void *dir, void *arg)
+{
+    int fd, ret = -1;
+    struct stat st;
+
+    if((fd = open(path, O_RDONLY)) != -1 && fstat(fd, &st) != -1)
+        ret = snapshot_add(arg, path, fd, &st);
+    if(ret == -1)
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    if(fd != -1)
+        close(fd);
+    return ret;
+}
+
+static int save(const char *file, char *const paths[], int nr_paths,
+    int nr_threads)
+{
+    struct walk_ops ops = { NULL, save_file, NULL };
+    char **abs;
+    int i, errors;
+
+    /* Record absolute paths, so that the snapshot can be restored from any
+     * directory. Paths that can't be resolved are left to the walk to
+     * report. */
+    if((abs = malloc(nr_paths * sizeof(*abs))) == NULL) {
+        perror("malloc");
+        return EXIT_FAILURE;
+    }
+    for(i = 0; i < nr_paths; i++)
+        if((abs[i] = realpath(paths[i], NULL)) == NULL &&
+                (abs[i] = strdup(paths[i])) == NULL) {
+            perror("malloc");
+            return EXIT_FAILURE;
+        }
+
+    if((ops.arg = snapshot_create(file)) == NULL) {
+        perror(file);
+        return EXIT_FAILURE;
+    }
+    errors = walk_paths(abs, nr_paths, nr_threads, &ops);
+    for(i = 0; i < nr_paths; i++)
+        free(abs[i]);
+    free(abs);
+    if(snapshot_close(ops.arg) == -1) {
+        perror(file);
+        return EXIT_FAILURE;
+    }
+    return errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* Wait until the read ahead of the chunk at offset, of len bytes, is done,
+ * by reading its last page: the kernel reads a chunk in order, and the page
+ * is locked until it has been read. */
+static void wait_chunk(int fd, const struct chunk *c, char *page)
+{
+    off_t last = c->offset + c->len - 1;
+
+    last -= last % snapshot->page_size;
+    pread(fd, page, snapshot->page_size, last);
+}
+
+/* Read ahead the runs of e with POSIX_FADV_WILLNEED, in chunks of at most
+ * CHUNK_SIZE, with up to depth chunks in flight, kept in a ring */
+static int restore_entry(const struct snapshot_entry *e, char *page,
+    struct chunk *chunks)
+{
+    char *path;
+    int fd, i = 0, n = 0, ret;
+    struct stat st;
+    struct snapshot_runs it;
+    uint64_t start, len;
+    off_t pos, end, chunk;
+
+    if((path = strndup(e->path, e->rec.path_len)) == NULL)
+        return -1;
+    if((fd = open(path, O_RDONLY)) == -1 || fstat(fd, &st) == -1)
+        goto error;
+    if(!force && (st.st_size != (off_t)e->rec.size || (!size_only &&
+                (st.st_mtim.tv_sec != e->rec.mtime_sec ||
+                 st.st_mtim.tv_nsec != e->rec.mtime_nsec)))) {
+        fprintf(stderr, "%s: changed since the snapshot, skipped\n", path);
+        __atomic_add_fetch(&changed, 1, __ATOMIC_RELAXED);
+        close(fd);
+        free(path);
+        return 0;
+    }
+
+    snapshot_runs_init(&it, e);
+    while(snapshot_next_run(&it, &start, &len)) {
+        pos = start * snapshot->page_size;
+        end = (start + len) * snapshot->page_size;
+        if(end > st.st_size)
+            end = st.st_size;
+        for(; pos < end; pos += chunk) {
+            chunk = end - pos < CHUNK_SIZE ? end - pos : CHUNK_SIZE;
+            if(n == depth) {
+                wait_chunk(fd, &chunks[i], page);
+                i = (i + 1) % depth;
+                n--;
+            }
+            if((ret = posix_fadvise(fd, pos, chunk, POSIX_FADV_WILLNEED))) {
+                errno = ret;
+                goto error;
+            }
+            chunks[(i + n++) % depth] = (struct chunk){ pos, chunk };
+        }
+    }
+    for(; n > 0; n--, i = (i + 1) % depth)
+        wait_chunk(fd, &chunks[i], page);
+
+    __atomic_add_fetch(&restored, 1, __ATOMIC_RELAXED);
+    close(fd);
+    free(path);
+    return 0;
+
+error:
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    if(fd != -1)
+        close(fd);
+    free(path);
+    return -1;
+}
+
+static void *restore_worker(void *unused)
+{
+    size_t i;
+    char *page;
+    struct chunk *chunks;
+
+    page = malloc(snapshot->page_size);
+    chunks = malloc(depth * sizeof(*chunks));
+    if(!page || !chunks) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    while((i = __atomic_fetch_add(&next_entry, 1, __ATOMIC_RELAXED)) <
+            snapshot->nr_entries)
+        if(restore_entry(&snapshot->entries[i], page, chunks) == -1)
+            __atomic_add_fetch(&errors, 1, __ATOMIC_RELAXED);
+    free(page);
+    free(chunks);
+    return NULL;
+}
+
+static int restore(const char *file, int nr_threads)
+{
+    pthread_t *threads;
+    int n;
+
+    if((snapshot = snapshot_load(file)) == NULL) {
+        perror(file);
+        return EXIT_FAILURE;
+    }
+    if(nr_threads == 0 && (nr_threads = sysconf(_SC_NPROCESSORS_ONLN)) <= 0)
+        nr_threads = 1;
+    if((threads = malloc(nr_threads * sizeof(*threads))) == NULL) {
+        perror("malloc");
+        return EXIT_FAILURE;
+    }
+    for(n = 0; n < nr_threads; n++)
+        if((errno = pthread_create(&threads[n], NULL, restore_worker, NULL))) {
+            if(n > 0)
+                break;
+            perror("pthread_create");
+            return EXIT_FAILURE;
+        }
+    while(n > 0)
+        pthread_join(threads[--n], NULL);
+
+    printf("files restored: %zu/%zu (%zu changed since the snapshot, "
+        "%d failed)\n", restored, snapshot->nr_entries, changed, errors);
+    free(threads);
+    snapshot_free(snapshot);
+    return errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s save [-j threads] <snapshot> <path>... "
+        "-- record which pages of files are cached\n", name);
+    fprintf(stderr, "       %s restore [-f|-s] [-j threads] [-d depth] "
+        "<snapshot> -- bring them back into the cache\n", name);
+    fprintf(stderr, "\t-j n\tscan or read files with n threads (default: "
+        "one per CPU)\n");
+    fprintf(stderr, "\t-d n\tkeep up to n 1M reads in flight per thread "
+        "(default: 16)\n");
+    fprintf(stderr, "\t-f\trestore files that changed since the snapshot\n");
+    fprintf(stderr, "\t-s\tonly skip files whose size changed, e.g. copies "
+        "on another host\n");
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    int opt, nr_threads = 0, restoring;
+
+    if(argc < 2 || (strcmp(argv[1], "save") && strcmp(argv[1], "restore")))
+        usage(argv[0]);
+    restoring = !strcmp(argv[1], "restore");
+    optind = 2;
+    while((opt = getopt(argc, argv, restoring ? "fsj:d:" : "j:")) != -1) {
+        switch(opt) {
+        case 'f': force = 1; break;
+        case 's': size_only = 1; break;
+        case 'j': nr_threads = atoi(optarg); break;
+        case 'd': depth = atoi(optarg); break;
+        default: usage(argv[0]);
+        }
+    }
+    if(nr_threads < 0 || depth < 1)
+        usage(argv[0]);
+
+    if(restoring) {
+        if(argc - optind != 1)
+            usage(argv[0]);
+        return restore(argv[optind], nr_threads);
+    }
+    if(argc - optind < 2)
+        usage(argv[0]);
+    return save(argv[optind], argv + optind + 1, argc - optind - 1,
+        nr_threads);
+}
@@ -1,12 +1,46 @@
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
 #include <fcntl.h>
-#include <sys/mman.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
-#include <error.h>
+#include <errno.h>
 #include <stdio.h>
+#include <pthread.h>
+
+#include "residency.h"
+#include "walk.h"
+
+enum { OUTPUT_TEXT, OUTPUT_CSV, OUTPUT_JSON };
+
+struct counts {
+    size_t size, pages, cached;
+};
+
+/* totals of a directory and everything below it, kept with -d */
+struct dir {
+    char *path;
+    struct dir *parent, *next;
+    struct counts c;
+};
+
+struct top {
+    char *path;
+    struct counts c;
+};
+
+static int PAGESIZE;
+static int output = OUTPUT_TEXT;
+static int quiet, show_path, dirs, not_cached;
+static struct dir *dir_list, **dir_tail = &dir_list;
+static struct counts total;
+
+/* with -t n, the n files with the most cached pages, as a min-heap */
+static struct top *top;
+static int top_size, nr_top;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
 
 int exiterr(const char *s)
 {
@@ -14,96 +48,409 @@ int exiterr(const char *s)
     exit(-1);
 }
 
-int main(int argc, char *argv[])
+static void print_path(const char *s)
+{
+    putchar('"');
+    for(; *s; s++) {
+        if(output == OUTPUT_CSV && *s == '"')
+            putchar('"');
+        else if(output == OUTPUT_JSON && (*s == '"' || *s == '\\'))
+            putchar('\\');
+        if(output == OUTPUT_JSON && (unsigned char)*s < 0x20)
+            printf("\\u%04x", *s);
+        else
+            putchar(*s);
+    }
+    putchar('"');
+}
+
+static void print_counts(const char *type, const char *path,
+    const struct counts *c)
+{
+    switch(output) {
+    case OUTPUT_TEXT:
+        printf("pages in cache: %zu/%zu (%.1f%%)  [filesize=%.1fK, "
+            "pagesize=%dK]", c->cached, c->pages,
+            c->pages ? 100.0 * c->cached / c->pages : 0.0,
+            1.0 * c->size / 1024, PAGESIZE / 1024);
+        if(show_path)
+            printf("  %s", path ? path : type);
+        putchar('\n');
+        break;
+    case OUTPUT_CSV:
+        printf("%s,", type);
+        if(path)
+            print_path(path);
+        printf(",%zu,%zu,%zu\n", c->size, c->pages, c->cached);
+        break;
+    case OUTPUT_JSON:
+        printf("{\"type\":\"%s\",", type);
+        if(path) {
+            printf("\"path\":");
+            print_path(path);
+            putchar(',');
+        }
+        printf("\"size\":%zu,\"pages\":%zu,\"cached\":%zu}\n",
+            c->size, c->pages, c->cached);
+        break;
+    }
+}
+
+static void add_counts(struct counts *to, const struct counts *c)
+{
+    __atomic_add_fetch(&to->size, c->size, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&to->pages, c->pages, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&to->cached, c->cached, __ATOMIC_RELAXED);
+}
+
+static void sift_down(int i)
+{
+    struct top t;
+    int j;
+
+    for(; (j = 2 * i + 1) < nr_top; i = j) {
+        if(j + 1 < nr_top && top[j + 1].c.cached < top[j].c.cached)
+            j++;
+        if(top[i].c.cached <= top[j].c.cached)
+            break;
+        t = top[i];
+        top[i] = top[j];
+        top[j] = t;
+    }
+}
+
+static void add_top(const char *path, const struct counts *c)
+{
+    struct top t;
+    int i;
+
+    if(nr_top == top_size && c->cached <= top[0].c.cached)
+        return;
+    if((t.path = strdup(path)) == NULL)
+        exiterr("strdup");
+    t.c = *c;
+
+    if(nr_top == top_size) {
+        free(top[0].path);
+        top[0] = t;
+        sift_down(0);
+        return;
+    }
+    for(i = nr_top++; i > 0 && top[(i - 1) / 2].c.cached > t.c.cached;
+            i = (i - 1) / 2)
+        top[i] = top[(i - 1) / 2];
+    top[i] = t;
+}
+
+static int cmp_top(const void *a, const void *b)
 {
-    int i, j;
-    int pages;
-    int PAGESIZE;
+    const struct top *x = a, *y = b;
+    if(x->c.cached != y->c.cached)
+        return x->c.cached < y->c.cached ? 1 : -1;
+    return strcmp(x->path, y->path);
+}
 
-    int quiet = 0;
-    int verbose = 0;
+static void *new_dir(const char *path, void *parent, void *arg)
+{
+    struct dir *d;
 
+    if((d = calloc(1, sizeof(*d))) == NULL || (d->path = strdup(path)) == NULL)
+        exiterr("malloc");
+    d->parent = parent;
+    *dir_tail = d;
+    dir_tail = &d->next;
+    return d;
+}
+
+static int count_file(const char *path, void *dir, void *arg)
+{
     int fd;
     struct stat st;
-    void *file = NULL;
-    unsigned char *pageinfo = NULL;
+    struct counts c;
+    struct dir *d;
 
-    PAGESIZE = getpagesize();
+    if((fd = open(path, O_RDONLY)) == -1 || fstat(fd, &st) == -1)
+        goto error;
+    c.size = st.st_size;
+    c.pages = (st.st_size + PAGESIZE - 1) / PAGESIZE;
+    if(fd_count_resident(fd, 0, 0, &c.cached) == -1)
+        goto error;
+    close(fd);
+
+    for(d = dir; d; d = d->parent)
+        add_counts(&d->c, &c);
+    add_counts(&total, &c);
+    if(c.cached != c.pages)
+        __atomic_store_n(&not_cached, 1, __ATOMIC_RELAXED);
 
-    if(argc > 1) {
-        if(!strcmp("-v", argv[1]))
-            verbose = 1;
-        else if(!strcmp("-q", argv[1]))
-            quiet = 1;
-    } else {
-        fprintf(stderr, "usage: %s [-qv] <file> "
-            "-- print out cache statistics\n", argv[0]);
-        fprintf(stderr, "\t-v\tprint verbose cache map\n");
-        fprintf(stderr, "\t-q\texit code tells if file is fully cached\n");
-        exit(1);
+    if(!quiet && (top_size || !dirs)) {
+        pthread_mutex_lock(&lock);
+        if(top_size)
+            add_top(path, &c);
+        else
+            print_counts("file", path, &c);
+        pthread_mutex_unlock(&lock);
     }
+    return 0;
 
-    if(quiet || verbose)
-        argv++;
+error:
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    if(fd != -1)
+        close(fd);
+    return -1;
+}
 
-    fd = open(argv[1], O_RDONLY);
-    if(fd == -1)
-        exiterr("open");
+/* The cache map has a cell per page if the file is small enough for
+ * MAP_LINES lines of PAGES_PER_LINE pages, or a resolution is given with
+ * -r. Otherwise, each cell stands for as many pages as it takes to fit the
+ * map into MAP_LINES lines as wide as the terminal, and shows how many of
+ * them are cached. */
+#define PAGES_PER_LINE 32
+#define MAP_LINES 24
+
+struct map {
+    size_t per_cell, per_line;
+    int label_width;
+    size_t page;                     /* first page of the current cell */
+    size_t cell_pages, cell_cached;
+    size_t nr_cells;                 /* cells in the current line */
+    char *line;
+    size_t len;
+};
+
+static const char glyphs[] = " .:oOx";
+
+static void put_cell(struct map *m)
+{
+    char c;
 
-    if(fstat(fd, &st) == -1)
-        exiterr("fstat");
-    if(!S_ISREG(st.st_mode)) {
-        fprintf(stderr, "%s: S_ISREG: not a regular file", argv[1]);
-        return EXIT_FAILURE;
+    if(m->nr_cells == 0)
+        m->len = sprintf(m->line, "%*zu: |", m->label_width, m->page);
+
+    /* ' ' for none, 'x' for all and four steps in between */
+    if(m->cell_cached == 0)
+        c = glyphs[0];
+    else if(m->cell_cached == m->cell_pages)
+        c = glyphs[sizeof(glyphs) - 2];
+    else
+        c = glyphs[1 + 4 * m->cell_cached / m->cell_pages];
+    m->line[m->len++] = c;
+    if(m->per_cell == 1 || m->nr_cells + 1 == m->per_line)
+        m->line[m->len++] = '|';
+
+    m->page += m->cell_pages;
+    m->cell_pages = m->cell_cached = 0;
+    if(++m->nr_cells == m->per_line) {
+        m->line[m->len++] = '\n';
+        fwrite(m->line, 1, m->len, stdout);
+        m->nr_cells = 0;
     }
-    if(st.st_size == 0) {
-        printf("pages in cache: %d/%d (%.1f%%)  [filesize=%.1fK, "
-                "pagesize=%dK]\n", 0, 0, 0.0,
-                0.0, PAGESIZE / 1024);
-        return EXIT_SUCCESS;
+}
+
+static int map_window(off_t pos, size_t nr_pages, const unsigned char *vec,
+    void *arg)
+{
+    struct map *m = arg;
+    size_t i, n;
+
+    for(i = 0; i < nr_pages; i += n) {
+        n = m->per_cell - m->cell_pages;
+        if(n > nr_pages - i)
+            n = nr_pages - i;
+        m->cell_cached += m->per_cell == 1 ? vec[i] & 1 :
+            count_resident(vec + i, n);
+        m->cell_pages += n;
+        if(m->cell_pages == m->per_cell)
+            put_cell(m);
     }
+    return 0;
+}
 
-    pages = (st.st_size + PAGESIZE - 1) / PAGESIZE;
-    pageinfo = calloc(sizeof(*pageinfo), pages);
-    if(!pageinfo)
-        exiterr("calloc");
+static int terminal_width(void)
+{
+    struct winsize ws;
+    char *columns;
 
-    file = mmap(NULL, st.st_size, PROT_NONE, MAP_SHARED, fd, 0);
-    if(file == MAP_FAILED)
-        exiterr("mmap");
-    if(mincore(file, st.st_size, pageinfo) == -1)
-        exiterr("mincore");
+    if(ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0)
+        return ws.ws_col;
+    if((columns = getenv("COLUMNS")) && atoi(columns) > 0)
+        return atoi(columns);
+    return 80;
+}
 
-    i = j = 0;
-    while(i < pages)
-        if(pageinfo[i++] & 1)
-            j++;
+static int print_map(int fd, size_t pages, size_t per_cell)
+{
+    struct map m;
+    int ret;
 
-    if(quiet) {
-        if(j == i)
-            return EXIT_SUCCESS;
-        return EXIT_FAILURE;
+    memset(&m, 0, sizeof(m));
+    m.label_width = snprintf(NULL, 0, "%zu", pages);
+    if(m.label_width < 6)
+        m.label_width = 6;
+    m.per_line = terminal_width() - m.label_width - 4;
+    if(m.per_line < 8)
+        m.per_line = 8;
+    if(per_cell == 0 && pages > MAP_LINES * PAGES_PER_LINE)
+        per_cell = (pages + MAP_LINES * m.per_line - 1) /
+            (MAP_LINES * m.per_line);
+    if(per_cell <= 1) {
+        per_cell = 1;
+        m.per_line = PAGES_PER_LINE;
+    }
+    m.per_cell = per_cell;
+    if((m.line = malloc(m.label_width + 2 * m.per_line + 8)) == NULL)
+        exiterr("malloc");
+
+    printf("\ncache map:");
+    if(per_cell > 1)
+        printf(" %zu pages per cell, %s = 0%%, 1-24%%, 25-49%%, 50-74%%, "
+            "75-99%%, 100%% cached", per_cell, "' .:oOx'");
+    printf("\n");
+    ret = fd_residency(fd, 0, 0, map_window, &m);
+    if(ret == 0 && m.cell_pages)
+        put_cell(&m);
+    if(ret == 0 && m.nr_cells) {
+        if(per_cell > 1)
+            m.line[m.len++] = '|';
+        m.line[m.len++] = '\n';
+        fwrite(m.line, 1, m.len, stdout);
     }
+    free(m.line);
+    return ret;
+}
 
-    printf("pages in cache: %d/%d (%.1f%%)  [filesize=%.1fK, "
-        "pagesize=%dK]\n", j, i, 100.0 * j / i,
-        1.0 * st.st_size / 1024, PAGESIZE / 1024);
+/* -R: the resident runs of a file as byte offset and length */
+struct runs {
+    off_t size, start;
+    int in_run;
+};
 
-#define PAGES_PER_LINE 32
-    if(verbose) {
-        printf("\ncache map:\n");
-        for(i = 0; i <= (pages - 1) / PAGES_PER_LINE; i++) {
-            printf("%6d: |", i * PAGES_PER_LINE);
-            for(j = 0; j < PAGES_PER_LINE; j++) {
-                if(i * PAGES_PER_LINE + j == pages)
-                    break;
-                printf("%c|",
-                    pageinfo[i * PAGES_PER_LINE + j] & 1 ? 'x' : ' ');
-            }
-            printf("\n");
+static int runs_window(off_t pos, size_t nr_pages, const unsigned char *vec,
+    void *arg)
+{
+    struct runs *r = arg;
+    size_t i = 0;
+
+    while((i = find_resident(vec, i, nr_pages, !r->in_run)) < nr_pages) {
+        if(r->in_run)
+            printf("%lld %lld\n", (long long)r->start,
+                (long long)(pos + (off_t)i * PAGESIZE - r->start));
+        else
+            r->start = pos + (off_t)i * PAGESIZE;
+        r->in_run = !r->in_run;
+    }
+    return 0;
+}
+
+static int print_runs(int fd, off_t size)
+{
+    struct runs r = { size, 0, 0 };
+
+    if(fd_residency(fd, 0, 0, runs_window, &r) == -1)
+        return -1;
+    if(r.in_run)
+        printf("%lld %lld\n", (long long)r.start, (long long)(size - r.start));
+    return 0;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-qvR] [-r n] [-cdJ] [-j threads] [-t n] <path>... "
+        "-- print out cache statistics\n", name);
+    fprintf(stderr, "\t-v\tprint verbose cache map of a single file\n");
+    fprintf(stderr, "\t-r n\tshow n pages per cell in the map (default: "
+        "fit the terminal)\n");
+    fprintf(stderr, "\t-R\tprint offset and length of cached ranges of a "
+        "single file\n");
+    fprintf(stderr, "\t-q\texit code tells if all files are fully cached\n");
+    fprintf(stderr, "\t-d\tprint totals per directory instead of per file\n");
+    fprintf(stderr, "\t-t n\tprint only the n files with most pages "
+        "cached\n");
+    fprintf(stderr, "\t-j n\tscan files with n threads (default: one per "
+        "CPU)\n");
+    fprintf(stderr, "\t-c\tprint CSV\n");
+    fprintf(stderr, "\t-J\tprint JSON, one object per line\n");
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    int i, opt, errors;
+    int verbose = 0, runs = 0, nr_threads = 0;
+    size_t per_cell = 0;
+    struct stat st;
+    struct counts c;
+    struct dir *d;
+    struct walk_ops ops = { NULL, count_file, NULL };
+
+    PAGESIZE = getpagesize();
+
+    while((opt = getopt(argc, argv, "qvr:Rdt:j:cJ")) != -1) {
+        switch(opt) {
+        case 'q': quiet = 1; break;
+        case 'v': verbose = 1; break;
+        case 'r': per_cell = strtoul(optarg, NULL, 10); break;
+        case 'R': runs = 1; break;
+        case 'd': dirs = 1; break;
+        case 't': top_size = atoi(optarg); break;
+        case 'j': nr_threads = atoi(optarg); break;
+        case 'c': output = OUTPUT_CSV; break;
+        case 'J': output = OUTPUT_JSON; break;
+        default: usage(argv[0]);
         }
     }
+    if(optind == argc || top_size < 0 || nr_threads < 0)
+        usage(argv[0]);
+
+    if(verbose || runs) {
+        if(optind != argc - 1) {
+            fprintf(stderr, "%s: -%c needs a single file\n", argv[0],
+                verbose ? 'v' : 'R');
+            return EXIT_FAILURE;
+        }
+        if((i = open(argv[optind], O_RDONLY)) == -1)
+            exiterr("open");
+        if(fstat(i, &st) == -1)
+            exiterr("fstat");
+        if(!S_ISREG(st.st_mode)) {
+            fprintf(stderr, "%s: not a regular file\n", argv[optind]);
+            return EXIT_FAILURE;
+        }
+        if(runs) {
+            if(print_runs(i, st.st_size) == -1)
+                exiterr("mincore");
+            return EXIT_SUCCESS;
+        }
+        c.size = st.st_size;
+        c.pages = (st.st_size + PAGESIZE - 1) / PAGESIZE;
+        if(fd_count_resident(i, 0, 0, &c.cached) == -1)
+            exiterr("mincore");
+        print_counts("file", argv[optind], &c);
+        if(c.pages && print_map(i, c.pages, per_cell) == -1)
+            exiterr("mincore");
+        return EXIT_SUCCESS;
+    }
+
+    if(top_size && (top = malloc(top_size * sizeof(*top))) == NULL)
+        exiterr("malloc");
+    if(dirs)
+        ops.dir = new_dir;
+    if(output == OUTPUT_CSV)
+        printf("type,path,size,pages,cached\n");
+    show_path = argc - optind > 1 || dirs || top_size ||
+        (stat(argv[optind], &st) == 0 && S_ISDIR(st.st_mode));
+
+    errors = walk_paths(argv + optind, argc - optind, nr_threads, &ops);
+    if(quiet)
+        return errors || not_cached ? EXIT_FAILURE : EXIT_SUCCESS;
+
+    qsort(top, nr_top, sizeof(*top), cmp_top);
+    for(i = 0; i < nr_top; i++)
+        print_counts("file", top[i].path, &top[i].c);
+    for(d = dir_list; d; d = d->next)
+        print_counts("dir", d->path, &d->c);
+    if(show_path || output != OUTPUT_TEXT)
+        print_counts("total", NULL, &total);
 
-    munmap(file, st.st_size);
-    return EXIT_SUCCESS;
+    return errors ? EXIT_FAILURE : EXIT_SUCCESS;
 }
@@ -1,39 +1,155 @@
+#define _GNU_SOURCE
+#include <sys/stat.h>
+#include <sys/resource.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
+#include <dlfcn.h>
+#include <string.h>
+
+#include "fcntl_helpers.h"
+#include "residency.h"
+#include "stats.h"
+#include "trace.h"
 
 /* Since open() and close() are re-defined in nocache.c, it's not
  * possible to include <fcntl.h> there. So we do it here. */
 
+int (*_original_fcntl)(int fd, int cmd, ...);
+
+/* libc's fcntl(): nocache.c hooks fcntl(), and the hook would track the
+ * fds duplicated here for the library's own use as if the program had
+ * made them */
+static int real_fcntl(int fd, int cmd, int arg)
+{
+    if(!_original_fcntl)
+        _original_fcntl = (int (*)(int, int, ...)) dlsym(RTLD_NEXT, "fcntl");
+    return _original_fcntl(fd, cmd, arg);
+}
+
+/* Drop the range from the cache, in up to n passes that each retry what is
+ * still cached; see fd_evict_range(). */
 int fadv_dontneed(int fd, off_t offset, off_t len, int n)
 {
-        int i, ret;
-        for(i = 0, ret = 0; i < n && ret == 0; i++)
-            ret = posix_fadvise(fd, offset, len, POSIX_FADV_DONTNEED);
+        int ret;
+        struct stat st;
+        struct evict_stats es;
+
+        if(stats_enabled) {
+            if(len == 0 && fstat(fd, &st) != -1 && st.st_size > offset)
+                stats_add(STAT_PAGES_ADVISED,
+                    (st.st_size - offset + getpagesize() - 1) / getpagesize());
+            else if(len > 0)
+                stats_add(STAT_PAGES_ADVISED,
+                    (len + getpagesize() - 1) / getpagesize());
+        }
+        TRACE(TRACE_FADVISE, fd, offset, len);
+        ret = fd_evict_range(fd, offset, len, n, &es);
+        stats_add(STAT_FADVISE, es.fadvise);
+        stats_add(STAT_EVICT_CHECKS, es.checks);
+        stats_add(STAT_PAGES_LEFT, es.left);
+        if(es.left)
+            TRACE(TRACE_RESIDUAL, fd, offset, es.left);
         return ret;
 }
 
 int fadv_noreuse(int fd, off_t offset, off_t len)
 {
+        stats_add(STAT_FADVISE, 1);
         return posix_fadvise(fd, offset, len, POSIX_FADV_NOREUSE);
 }
 
 int valid_fd(int fd)
 {
     /* will return 1 if fd is opened */
-    return fcntl(fd, F_GETFL) != -1 || errno != EBADF;
+    return real_fcntl(fd, F_GETFL, 0) != -1 || errno != EBADF;
 }
 
 void sync_if_writable(int fd)
 {
     int r;
-    if((r = fcntl(fd, F_GETFL)) == -1)
+    if((r = real_fcntl(fd, F_GETFL, 0)) == -1)
         return;
-    if((r & O_ACCMODE) != O_RDONLY)
+    if((r & O_ACCMODE) != O_RDONLY) {
         fdatasync(fd);
+        stats_add(STAT_FDATASYNC, 1);
+    }
+}
+
+int fcntl_getfl(int fd)
+{
+    return real_fcntl(fd, F_GETFL, 0);
+}
+
+/* the open(2) flags equivalent to an fopen(3) mode */
+int fopen_flags(const char *mode)
+{
+    int flags;
+
+    switch(mode[0]) {
+    case 'w': flags = O_WRONLY | O_CREAT | O_TRUNC; break;
+    case 'a': flags = O_WRONLY | O_CREAT | O_APPEND; break;
+    default: flags = O_RDONLY;
+    }
+    if(strchr(mode, '+'))
+        flags = (flags & ~O_ACCMODE) | O_RDWR;
+    return flags;
+}
+
+/* Whether writes through an fd opened with flags go to the end of the
+ * file, wherever its position is; unknown flags (-1) count as yes. */
+int flags_append(int flags)
+{
+    return flags == -1 || (flags & O_APPEND);
 }
 
 int fcntl_dupfd(int fd, int arg)
 {
-    return fcntl(fd, F_DUPFD, arg);
+    return real_fcntl(fd, F_DUPFD, arg);
+}
+
+/* Whether an fcntl() command duplicates the fd */
+int fcntl_is_dupfd(int cmd)
+{
+    return cmd == F_DUPFD || cmd == F_DUPFD_CLOEXEC;
+}
+
+/* Duplicate fd for the library's own use, close-on-exec and at or above
+ * PRIVATE_FD_MIN, so that it doesn't take the lowest free number, which the
+ * program may be about to reopen (as a daemon does with 0, 1 and 2) or
+ * close again in a loop. Under a lower RLIMIT_NOFILE, the upper half of
+ * what is allowed is used. */
+int fcntl_dupfd_private(int fd)
+{
+    struct rlimit rlim;
+    int newfd;
+
+    if((newfd = real_fcntl(fd, F_DUPFD_CLOEXEC, PRIVATE_FD_MIN)) != -1 ||
+            errno != EINVAL || getrlimit(RLIMIT_NOFILE, &rlim) == -1)
+        return newfd;
+    return real_fcntl(fd, F_DUPFD_CLOEXEC, (int)(rlim.rlim_cur / 2));
+}
+
+void sync_range(int fd, off_t offset, off_t len)
+{
+    sync_file_range(fd, offset, len, SYNC_FILE_RANGE_WAIT_BEFORE |
+        SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+    stats_add(STAT_SYNC_FILE_RANGE, 1);
+}
+
+void start_writeback(int fd, off_t offset, off_t len)
+{
+    sync_file_range(fd, offset, len, SYNC_FILE_RANGE_WRITE);
+    stats_add(STAT_SYNC_FILE_RANGE, 1);
+}
+
+/* Like sync_if_writable(), but only write back the file's data, without
+ * committing its metadata. */
+void sync_range_if_writable(int fd)
+{
+    int r;
+    if((r = real_fcntl(fd, F_GETFL, 0)) == -1)
+        return;
+    if((r & O_ACCMODE) != O_RDONLY)
+        sync_range(fd, 0, 0);
 }
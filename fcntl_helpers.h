@@ -4,5 +4,17 @@ extern int fadv_dontneed(int fd, off_t offset, off_t len, int n);
 extern int fadv_noreuse(int fd, off_t offset, off_t len);
 extern int valid_fd(int fd);
 extern void sync_if_writable(int fd);
+extern void sync_range_if_writable(int fd);
+extern void sync_range(int fd, off_t offset, off_t len);
+extern void start_writeback(int fd, off_t offset, off_t len);
+extern int fcntl_getfl(int fd);
+extern int fopen_flags(const char *mode);
+extern int flags_append(int flags);
 extern int fcntl_dupfd(int fd, int arg);
+extern int fcntl_is_dupfd(int cmd);
+/* fcntl() is hooked, too; the helpers call the one it wraps */
+extern int (*_original_fcntl)(int fd, int cmd, ...);
+/* lowest fd number fcntl_dupfd_private() returns, if the limit allows */
+#define PRIVATE_FD_MIN 512
+extern int fcntl_dupfd_private(int fd);
 #endif
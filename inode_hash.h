@@ -0,0 +1,13 @@
+#ifndef _INODE_HASH_H
+#define _INODE_HASH_H
+
+#include <stdint.h>
+
+/* Hash of a file's (st_dev, st_ino) for the tables keyed by inode. The high
+ * bits are the best mixed; take bucket indexes from those. */
+static inline uint64_t inode_hash(uint64_t dev, uint64_t ino)
+{
+    return ((dev * 0x9e3779b97f4a7c15ULL) ^ ino) * 0xff51afd7ed558ccdULL;
+}
+
+#endif
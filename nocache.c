@@ -14,18 +14,53 @@
 #include <sys/resource.h>
 #include <assert.h>
 #include <signal.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/uio.h>
+#include <dirent.h>
+#include <stdarg.h>
 
 #include "pageinfo.h"
 #include "fcntl_helpers.h"
+#include "inode_hash.h"
+#include "policy.h"
+#include "pressure.h"
+#include "registry.h"
+#include "stats.h"
+#include "trace.h"
+
+struct tracked_inode;
+struct fd_dir;
 
 static void init(void) __attribute__((constructor));
 static void destroy(void) __attribute__((destructor));
-static void init_mutexes(void);
+static void fds_prepare(void);
+static void fds_parent(void);
+static void fds_child(void);
+static struct fd_slot *lock_slot(int fd, bool create);
+static void unlock_slot(int fd, struct fd_slot *slot);
 static void init_debugging(void);
 static void handle_stdout(void);
-
-static void store_pageinfo(int fd);
-static void free_unclaimed_pages(int fd, bool block_signals);
+static void adopt_inherited(void);
+
+static void store_pageinfo(int fd, const char *path, int flags);
+static void free_unclaimed_pages(int fd);
+static void evict(int fd, struct file_pageinfo *pi);
+static bool async_enqueue(int fd, struct file_pageinfo *pi);
+static void async_drain(void);
+static void async_prepare(void);
+static void async_parent(void);
+static void async_child(void);
+static void drop_behind(int fd, off_t offset, size_t len, bool write);
+static void write_behind(int fd, off_t offset, size_t len);
+static void touch_pageinfo(int fd, off_t offset, size_t len);
+static void seen_pos(int fd, off_t pos, bool shared);
+static void budget_touch(int fd, off_t offset, size_t len, bool write);
+static size_t budget_close(int fd, struct tracked_inode *inode,
+    struct byterange **ranges);
+static void budget_drain(void);
+static void budget_child(bool consistent);
+static struct fd_dir *grow_dir(struct fd_dir *old, int i);
 
 int open(const char *pathname, int flags, mode_t mode);
 int open64(const char *pathname, int flags, mode_t mode);
@@ -37,10 +72,30 @@ int __openat_2(int dirfd, const char *pathname, int flags, mode_t mode)
     __attribute__ ((alias ("openat")));
 int dup(int oldfd);
 int dup2(int oldfd, int newfd);
+int dup3(int oldfd, int newfd, int flags);
+int fcntl(int fd, int cmd, ...);
+int fcntl64(int fd, int cmd, ...);
 int close(int fd);
 FILE *fopen(const char *path, const char *mode);
 FILE *fopen64(const char *path, const char *mode);
+FILE *fdopen(int fd, const char *mode);
 int fclose(FILE *fp);
+ssize_t read(int fd, void *buf, size_t count);
+ssize_t write(int fd, const void *buf, size_t count);
+ssize_t pread(int fd, void *buf, size_t count, off_t offset);
+ssize_t pwrite(int fd, const void *buf, size_t count, off_t offset);
+ssize_t pread64(int fd, void *buf, size_t count, off64_t offset);
+ssize_t pwrite64(int fd, const void *buf, size_t count, off64_t offset);
+ssize_t readv(int fd, const struct iovec *iov, int iovcnt);
+ssize_t writev(int fd, const struct iovec *iov, int iovcnt);
+off_t lseek(int fd, off_t offset, int whence);
+off64_t lseek64(int fd, off64_t offset, int whence);
+ssize_t sendfile(int out_fd, int in_fd, off_t *offset, size_t count);
+ssize_t sendfile64(int out_fd, int in_fd, off64_t *offset, size_t count);
+ssize_t splice(int fd_in, off64_t *off_in, int fd_out, off64_t *off_out,
+    size_t len, unsigned int flags);
+ssize_t copy_file_range(int fd_in, off64_t *off_in, int fd_out,
+    off64_t *off_out, size_t len, unsigned int flags);
 
 int (*_original_open)(const char *pathname, int flags, mode_t mode);
 int (*_original_open64)(const char *pathname, int flags, mode_t mode);
@@ -50,26 +105,144 @@ int (*_original_openat)(int dirfd, const char *pathname, int flags, mode_t mode)
 int (*_original_openat64)(int dirfd, const char *pathname, int flags, mode_t mode);
 int (*_original_dup)(int fd);
 int (*_original_dup2)(int newfd, int oldfd);
+int (*_original_dup3)(int oldfd, int newfd, int flags);
+int (*_original_fcntl64)(int fd, int cmd, ...);
 int (*_original_close)(int fd);
 FILE *(*_original_fopen)(const char *path, const char *mode);
 FILE *(*_original_fopen64)(const char *path, const char *mode);
+FILE *(*_original_fdopen)(int fd, const char *mode);
 int (*_original_fclose)(FILE *fp);
+ssize_t (*_original_read)(int fd, void *buf, size_t count);
+ssize_t (*_original_write)(int fd, const void *buf, size_t count);
+ssize_t (*_original_pread)(int fd, void *buf, size_t count, off_t offset);
+ssize_t (*_original_pwrite)(int fd, const void *buf, size_t count, off_t offset);
+ssize_t (*_original_pread64)(int fd, void *buf, size_t count, off64_t offset);
+ssize_t (*_original_pwrite64)(int fd, const void *buf, size_t count, off64_t offset);
+ssize_t (*_original_readv)(int fd, const struct iovec *iov, int iovcnt);
+ssize_t (*_original_writev)(int fd, const struct iovec *iov, int iovcnt);
+off_t (*_original_lseek)(int fd, off_t offset, int whence);
+off64_t (*_original_lseek64)(int fd, off64_t offset, int whence);
+ssize_t (*_original_sendfile)(int out_fd, int in_fd, off_t *offset, size_t count);
+ssize_t (*_original_sendfile64)(int out_fd, int in_fd, off64_t *offset, size_t count);
+ssize_t (*_original_splice)(int fd_in, off64_t *off_in, int fd_out,
+    off64_t *off_out, size_t len, unsigned int flags);
+ssize_t (*_original_copy_file_range)(int fd_in, off64_t *off_in, int fd_out,
+    off64_t *off_out, size_t len, unsigned int flags);
+
+
+/* Info about a file descriptor 'fd' is stored in a sparse, two-level table:
+ * fds->chunk[fd >> FDS_CHUNK_SHIFT] points to a chunk of FDS_CHUNK_SIZE
+ * slots, which is only allocated once an fd in its range is tracked for the
+ * first time. The directory itself starts out with room for FDS_DIR_MIN
+ * chunks and is doubled as higher fds are tracked; the directory it
+ * replaces is kept until destroy(), since readers don't lock it. This way,
+ * memory use and startup/teardown cost scale with the number of file
+ * descriptors actually in use, not with RLIMIT_NOFILE.
+ *
+ * There is no global lock on the hot path: fd_chunk_lock is only taken to
+ * allocate a chunk (once per FDS_CHUNK_SIZE fds), chunks are then read with
+ * an atomic load, and max_fd_observed is an atomic high-water mark.
+ * Callers MUST look up and lock a slot via lock_slot() and release it with
+ * unlock_slot(). In between, they hold a reference in one of the
+ * FDS_REF_STRIPES counters (chosen by fd, so that threads working on
+ * different fds don't share a cache line). destroy() only frees the table
+ * once it has set fds_shutdown and all counters have dropped to zero. */
+#define FDS_CHUNK_SHIFT 8
+#define FDS_CHUNK_SIZE (1 << FDS_CHUNK_SHIFT)
+#define FDS_REF_STRIPES 64
+#define FDS_DIR_MIN 4
+
+/* What we know about a tracked file is kept per inode, so that a file that
+ * is open more than once (or dup()ed) is scanned once, and its pages are
+ * only dropped when the last fd for it is closed; otherwise, the first
+ * close() would drop pages the other fds are still reading. The records are
+ * kept in a hash table by (st_dev, st_ino) with a lock per bucket, which
+ * protects the chain and the refcounts; pi is protected by the record's own
+ * lock, or owned by whoever dropped the last reference. Both are only taken
+ * with a slot locked, in this order: slot, bucket, record (and in budget
+ * mode: slot, budget_lock, bucket, record). */
+#define INODE_BUCKETS 256
+
+struct tracked_inode {
+    struct tracked_inode *next;  /* in its bucket */
+    dev_t dev;
+    ino_t ino;
+    int refs;                    /* fds that point here */
+    uint32_t shared;             /* entry in the registry, 0 if none */
+    pthread_mutex_t lock;
+    struct file_pageinfo pi;
+    /* budget mode, protected by budget_lock */
+    int budget_fd;                   /* to drop extents with, or -1 */
+    struct budget_extent **extents;  /* by index, NULL if not charged */
+    size_t extents_size, nr_charged;
+    /* in a forked child: in use by another thread of the parent at fork,
+     * so the record may be half changed; it is forgotten (see fds_child()) */
+    bool lost;
+};
+
+static struct inode_bucket {
+    pthread_mutex_t lock;
+    struct tracked_inode *head;
+} inodes[INODE_BUCKETS];
+
+struct fd_slot {
+    pthread_mutex_t lock;
+    struct tracked_inode *inode;  /* NULL if the fd is not tracked */
+    off_t behind;     /* drop-behind: everything before this was dropped */
+    size_t progress;  /* drop-behind: bytes transferred since last check */
+    off_t wb_done;       /* write-behind: written back and dropped */
+    off_t wb_submitted;  /* write-behind: writeback started until here */
+    size_t wb_progress;  /* write-behind: bytes written since last check */
+    size_t budget_last;  /* budget: index + 1 of the extent used last */
+    /* lazy and budget modes: the file position as the hooks have seen it
+     * move, -1 if unknown; it is not kept if other fds or processes may
+     * move it, too (O_APPEND, dup, fork, stdio) */
+    off_t pos;
+    bool pos_shared;
+    unsigned int fork_gen;  /* fork_gen when the fd was tracked */
+};
+
+struct fd_chunk {
+    struct fd_chunk *next;  /* list of all allocated chunks */
+    struct fd_slot slot[FDS_CHUNK_SIZE];
+};
+
+struct fds_ref {
+    int count;
+} __attribute__((aligned(64)));
+
+struct fd_dir {
+    struct fd_dir *prev;  /* the directory this one replaced */
+    int nr_chunks;
+    struct fd_chunk *chunk[];
+};
 
-
-/* Info about a file descriptor 'fd' is stored in fds[fd]. Before accessing an
- * element, callers MUST both check fds_lock != NULL and then acquire
- * fds_lock[fd] while holding the fds_iter_lock. While any mutex in fds_lock is
- * held, fds_lock will not be freed and set to NULL. */
 static int max_fds;
-static struct file_pageinfo *fds;
-static pthread_mutex_t *fds_lock;
-static pthread_mutex_t fds_iter_lock;
-static int max_fd_observed;  /* guarded by fds_iter_lock */
+static struct fd_dir *fds;
+static struct fd_chunk *fd_chunk_list;
+static pthread_mutex_t fd_chunk_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct fds_ref fds_refs[FDS_REF_STRIPES];
+static int fds_shutdown;
+static int max_fd_observed;
+
+/* Set while the current thread holds a slot lock. If a signal handler
+ * interrupts us there and calls one of our hooks, the nested call must not
+ * touch the fd table, or it could deadlock on the lock this thread already
+ * holds; it will simply not be tracked. Unlike blocking signals around
+ * each table access, this does not cost any syscalls. */
+static __thread volatile sig_atomic_t in_slot
+    __attribute__((tls_model("initial-exec")));
 static size_t PAGESIZE;
 
 static char *env_nr_fadvise = "NOCACHE_NR_FADVISE";
 static int nr_fadvise;
 
+static char *env_fadvise_gap = "NOCACHE_FADVISE_GAP";
+static size_t fadvise_gap;  /* in bytes */
+
+static char *env_max_fadvise = "NOCACHE_MAX_FADVISE";
+static size_t max_fadvise;  /* ranges per close, 0 if unlimited */
+
 static char *env_debugfd = "NOCACHE_DEBUGFD";
 int debugfd = -1;
 FILE *debugfp;
@@ -77,8 +250,85 @@ FILE *debugfp;
 static char *env_flushall = "NOCACHE_FLUSHALL";
 static char flushall;
 
+static char *env_policy = "NOCACHE_POLICY";
+
+static char *env_stats = "NOCACHE_STATS";
+
+static char *env_trace = "NOCACHE_TRACE";
+
 static char *env_max_fds = "NOCACHE_MAX_FDS";
-static rlim_t max_fd_limit = 1 << 20;
+static rlim_t max_fd_limit = INT_MAX;
+
+static char *env_dropbehind = "NOCACHE_DROPBEHIND";
+static off_t dropbehind;  /* window size in bytes, 0 if disabled */
+
+static char *env_scan_window = "NOCACHE_SCAN_WINDOW";
+
+static char *env_writebehind = "NOCACHE_WRITEBEHIND";
+static off_t writebehind;  /* chunk size in bytes, 0 if disabled */
+
+static char *env_lazy = "NOCACHE_LAZY";
+static size_t lazy;  /* segment size in bytes, 0 if disabled */
+
+/* Budget mode: the job may keep up to budget bytes of what it brought into
+ * the cache, across open and recently closed files. Reads and writes charge
+ * the file in extents of BUDGET_EXTENT bytes, each with what of it was not
+ * cached at open; beyond the budget, the least recently used extents are
+ * dropped (see budget_shrink()). A file stays in the inode table after its
+ * last close for as long as extents of it are charged. budget_lock protects
+ * the ring of extents and the budget fields of all records. Budget mode is
+ * off in lazy mode, and it does not use the registry.
+ *
+ * The budget is the job's, not each process's: the first process to see
+ * NOCACHE_BUDGET claims it by putting its pid into NOCACHE_BUDGET_PID, so
+ * the programs it execs keep the budget, while the processes it starts
+ * drop their pages at close as without one (forked children give it up in
+ * budget_child()). */
+static char *env_budget = "NOCACHE_BUDGET";
+static char *env_budget_pid = "NOCACHE_BUDGET_PID";
+#define BUDGET_EXTENT (2 * 1024 * 1024)
+struct budget_extent {
+    struct budget_extent *prev, *next;  /* in the ring the hand sweeps, or
+                                         * next in the list being dropped */
+    struct tracked_inode *inode;
+    size_t index;                       /* at index * BUDGET_EXTENT */
+    size_t charged;                     /* bytes not cached at open */
+    bool referenced, dirty;
+    bool dropping;                      /* off the ring, being dropped */
+};
+static size_t budget;  /* in bytes, 0 if disabled */
+static size_t budget_used;
+static struct budget_extent *budget_hand;
+static pthread_mutex_t budget_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Registry shared by the process tree, see registry.h. It is not used in
+ * lazy mode, where each process scans only what it touches. */
+static char *env_shared = "NOCACHE_SHARED";
+
+/* Adaptive eviction: decide at close time how much to drop by how short of
+ * memory the system is, see pressure.h. NOCACHE_PRESSURE holds the
+ * thresholds (or nothing, for the defaults); the others are for testing
+ * and tuning. */
+static char *env_pressure = "NOCACHE_PRESSURE";
+static char *env_pressure_root = "NOCACHE_PRESSURE_ROOT";
+static char *env_pressure_interval = "NOCACHE_PRESSURE_INTERVAL";
+
+/* Asynchronous close: instead of syncing and dropping pages in close(), the
+ * fd is duplicated and handed, along with its page info, to a worker thread
+ * via a bounded ring buffer of async_size jobs. If the queue is full, close()
+ * does the work itself. The worker is started on first use. */
+static char *env_async = "NOCACHE_ASYNC";
+struct async_job {
+    int fd;
+    struct file_pageinfo pi;
+};
+static size_t async_size;  /* 0 if disabled */
+static struct async_job *async_queue;
+static size_t async_head, async_len;
+static pthread_mutex_t async_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t async_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t async_thread;
+static bool async_running, async_stop;
 
 #define DEBUG(...) \
     do { \
@@ -87,12 +337,24 @@ static rlim_t max_fd_limit = 1 << 20;
         } \
     } while(0)
 
+/* Claim the budget for this process, unless another one has; see above. */
+static bool claim_budget(void)
+{
+    char *s, pid[16];
+
+    if((s = getenv(env_budget_pid)) != NULL)
+        return atoi(s) == getpid();
+    snprintf(pid, sizeof(pid), "%d", (int)getpid());
+    return setenv(env_budget_pid, pid, 1) == 0;
+}
+
 static void init(void)
 {
     int i;
     char *s;
     char *error;
     struct rlimit rlim;
+    unsigned int pressure_interval = 1000;  /* in milliseconds */
 
     if((s = getenv(env_nr_fadvise)) != NULL)
         nr_fadvise = atoi(s);
@@ -104,23 +366,71 @@ static void init(void)
     if(flushall <= 0)
         flushall = 0;
 
-    if((s = getenv(env_max_fds)) != NULL)
+    if((s = getenv(env_dropbehind)) != NULL)
+        dropbehind = parse_size(s);
+    if((s = getenv(env_writebehind)) != NULL)
+        writebehind = parse_size(s);
+
+    PAGESIZE = getpagesize();
+    if((s = getenv(env_scan_window)) != NULL && parse_size(s) != 0) {
+        pageinfo_scan_window = parse_size(s);
+        pageinfo_scan_window = (pageinfo_scan_window + PAGESIZE - 1)
+            / PAGESIZE * PAGESIZE;
+    }
+    if((s = getenv(env_lazy)) != NULL && (lazy = parse_size(s)) != 0) {
+        /* segments must start at page boundaries */
+        lazy = (lazy + PAGESIZE - 1) / PAGESIZE * PAGESIZE;
+    }
+    if((s = getenv(env_budget)) != NULL && !lazy && claim_budget())
+        budget = parse_size(s);
+
+    if((s = getenv(env_fadvise_gap)) != NULL && atoll(s) > 0)
+        fadvise_gap = atoll(s) * PAGESIZE;
+    if((s = getenv(env_max_fadvise)) != NULL && atoll(s) > 0)
+        max_fadvise = atoll(s);
+
+    if((s = getenv(env_async)) != NULL && atoll(s) > 0) {
+        async_size = atoll(s);
+        if((async_queue = calloc(async_size, sizeof(*async_queue))) == NULL)
+            async_size = 0;
+    }
+
+    if((s = getenv(env_stats)) != NULL)
+        stats_init(s);
+
+    /* These have to happen before the fd table exists, so that the policy
+     * and trace files are not tracked. */
+    if((s = getenv(env_trace)) != NULL)
+        trace_init(s);
+    if((s = getenv(env_policy)) != NULL)
+        policy_load(s);
+    if((s = getenv(env_shared)) != NULL && !lazy && !budget)
+        registry_init(s);
+
+    if((s = getenv(env_max_fds)) != NULL && atoll(s) < max_fd_limit)
         max_fd_limit = atoll(s);
 
     getrlimit(RLIMIT_NOFILE, &rlim);
-    max_fds = rlim.rlim_max;
-    if(max_fds > max_fd_limit)
+    if(rlim.rlim_max > max_fd_limit)
         max_fds = max_fd_limit;
+    else
+        max_fds = rlim.rlim_max;
 
-    if(max_fds == 0)
+    if(max_fds <= 0)
         return;  /* There's nothing to do for us here. */
 
-    init_mutexes();
-    /* make sure to re-initialize mutex if forked */
-    pthread_atfork(NULL, NULL, init_mutexes);
-
-    fds = malloc(max_fds * sizeof(*fds));
+    /* Only a small chunk directory is allocated up front; it grows, and
+     * the chunks are allocated, on first use in lock_slot(). */
+    fds = grow_dir(NULL, 0);
     assert(fds != NULL);
+    for(i = 0; i < INODE_BUCKETS; i++)
+        pthread_mutex_init(&inodes[i].lock, NULL);
+
+    /* Prepare handlers run in reverse order of registration, so the fd
+     * table is taken care of before async_lock is taken. */
+    if(async_size)
+        pthread_atfork(async_prepare, async_parent, async_child);
+    pthread_atfork(fds_prepare, fds_parent, fds_child);
 
     _original_open = (int (*)(const char *, int, mode_t)) dlsym(RTLD_NEXT, "open");
     _original_open64 = (int (*)(const char *, int, mode_t)) dlsym(RTLD_NEXT, "open64");
@@ -130,40 +440,375 @@ static void init(void)
     _original_openat64 = (int (*)(int, const char *, int, mode_t)) dlsym(RTLD_NEXT, "openat64");
     _original_dup = (int (*)(int)) dlsym(RTLD_NEXT, "dup");
     _original_dup2 = (int (*)(int, int)) dlsym(RTLD_NEXT, "dup2");
+    _original_dup3 = (int (*)(int, int, int)) dlsym(RTLD_NEXT, "dup3");
+    _original_fcntl = (int (*)(int, int, ...)) dlsym(RTLD_NEXT, "fcntl");
     _original_close = (int (*)(int)) dlsym(RTLD_NEXT, "close");
     _original_fopen = (FILE *(*)(const char *, const char *)) dlsym(RTLD_NEXT, "fopen");
     _original_fopen64 = (FILE *(*)(const char *, const char *)) dlsym(RTLD_NEXT, "fopen64");
+    _original_fdopen = (FILE *(*)(int, const char *)) dlsym(RTLD_NEXT, "fdopen");
     _original_fclose = (int (*)(FILE *)) dlsym(RTLD_NEXT, "fclose");
+    _original_read = (ssize_t (*)(int, void *, size_t)) dlsym(RTLD_NEXT, "read");
+    _original_write = (ssize_t (*)(int, const void *, size_t)) dlsym(RTLD_NEXT, "write");
+    _original_pread = (ssize_t (*)(int, void *, size_t, off_t)) dlsym(RTLD_NEXT, "pread");
+    _original_pwrite = (ssize_t (*)(int, const void *, size_t, off_t)) dlsym(RTLD_NEXT, "pwrite");
+    _original_pread64 = (ssize_t (*)(int, void *, size_t, off64_t)) dlsym(RTLD_NEXT, "pread64");
+    _original_pwrite64 = (ssize_t (*)(int, const void *, size_t, off64_t)) dlsym(RTLD_NEXT, "pwrite64");
+    _original_readv = (ssize_t (*)(int, const struct iovec *, int)) dlsym(RTLD_NEXT, "readv");
+    _original_writev = (ssize_t (*)(int, const struct iovec *, int)) dlsym(RTLD_NEXT, "writev");
+    _original_lseek = (off_t (*)(int, off_t, int)) dlsym(RTLD_NEXT, "lseek");
+    _original_lseek64 = (off64_t (*)(int, off64_t, int)) dlsym(RTLD_NEXT, "lseek64");
+    _original_sendfile = (ssize_t (*)(int, int, off_t *, size_t)) dlsym(RTLD_NEXT, "sendfile");
+    _original_splice = (ssize_t (*)(int, off64_t *, int, off64_t *, size_t, unsigned int)) dlsym(RTLD_NEXT, "splice");
 
     if ((error = dlerror()) != NULL)  {
         fprintf(stderr, "%s\n", error);
         exit(EXIT_FAILURE);
     }
 
-    PAGESIZE = getpagesize();
-    pthread_mutex_lock(&fds_iter_lock);
-    for(i = 0; i < max_fds; i++) {
-        pthread_mutex_lock(&fds_lock[i]);
-        fds[i].fd = -1;
-        pthread_mutex_unlock(&fds_lock[i]);
-    }
-    max_fd_observed = 0;
-    pthread_mutex_unlock(&fds_iter_lock);
+    /* This reads files through the original functions. */
+    if((s = getenv(env_pressure_interval)) != NULL && atoi(s) >= 0)
+        pressure_interval = atoi(s);
+    if((s = getenv(env_pressure)) != NULL)
+        pressure_init(s, getenv(env_pressure_root), pressure_interval);
+
     init_debugging();
     handle_stdout();
+    if(registry_enabled)
+        adopt_inherited();
+}
+
+/* Around fork(), the forking thread holds fd_chunk_lock, budget_lock and
+ * the lock of every inode bucket, which are only held briefly, but none of
+ * the slot or record locks, which other threads may hold for as long as a
+ * scan, an fdatasync() or a round of fadvise() takes. So the child gets a
+ * consistent copy of the chunk list, the inode table and the budget, while
+ * a slot or record may have been in the middle of a change; the child
+ * finds those by their locks, which stay locked, and forgets them. This
+ * costs the child time proportional to the chunks in use, and the parent
+ * none. If fork() is called from a signal handler that interrupted a hook,
+ * this thread may hold a lock itself, so the child re-initializes all
+ * locks instead.
+ *
+ * After fork(), parent and child share the file positions of all fds that
+ * are open at the time, so neither can keep track of them any more. Rather
+ * than marking every slot, fork_gen is counted up, and a slot that was
+ * tracked before is taken as shared once it is next used (see
+ * slot_pos_shared()). */
+static bool fork_locked;
+static unsigned int fork_gen;
+
+static void fds_prepare(void)
+{
+    int i;
+    struct tracked_inode *inode;
+
+    __atomic_add_fetch(&fork_gen, 1, __ATOMIC_RELAXED);
+    if((fork_locked = !in_slot)) {
+        pthread_mutex_lock(&fd_chunk_lock);
+        pthread_mutex_lock(&budget_lock);
+        for(i = 0; i < INODE_BUCKETS; i++)
+            pthread_mutex_lock(&inodes[i].lock);
+        /* The child holds the files we have open, too. */
+        for(i = 0; i < INODE_BUCKETS; i++)
+            for(inode = inodes[i].head; inode; inode = inode->next)
+                if(inode->shared)
+                    registry_prefork(inode->shared);
+    }
+}
+
+static void unlock_table(void)
+{
+    int i;
+
+    for(i = INODE_BUCKETS - 1; i >= 0; i--)
+        pthread_mutex_unlock(&inodes[i].lock);
+    pthread_mutex_unlock(&budget_lock);
+    pthread_mutex_unlock(&fd_chunk_lock);
+}
+
+static void fds_parent(void)
+{
+    if(fork_locked)
+        unlock_table();
+}
+
+/* In the child: whether a lock was held at fork, by a thread that doesn't
+ * exist here. It is free again afterwards. */
+static bool was_locked(pthread_mutex_t *lock)
+{
+    if(pthread_mutex_trylock(lock) == 0) {
+        pthread_mutex_unlock(lock);
+        return false;
+    }
+    pthread_mutex_init(lock, NULL);
+    return true;
+}
+
+/* Other threads of the parent do not exist in the child, so any reference
+ * they held must be dropped. What they were changing is forgotten: a slot
+ * is no longer tracked, and a record is taken out of the table, along with
+ * the references to it, so the child never drops its pages. */
+static void fds_child(void)
+{
+    int i;
+    struct fd_chunk *c;
+    struct fd_slot *slot;
+    struct tracked_inode *inode, **p;
+
+    stats_reset();
+    trace_reset();
+    registry_fork();
+    pressure_fork();
+    for(i = 0; i < FDS_REF_STRIPES; i++)
+        fds_refs[i].count = 0;
+    if(fork_locked) {
+        unlock_table();
+        for(i = 0; i < INODE_BUCKETS; i++)
+            for(p = &inodes[i].head; (inode = *p) != NULL;) {
+                if(inode->shared && !registry_hold(inode->shared))
+                    inode->shared = 0;
+                if((inode->lost = was_locked(&inode->lock)))
+                    *p = inode->next;
+                else
+                    p = &inode->next;
+            }
+        for(c = fd_chunk_list; c; c = c->next)
+            for(i = 0; i < FDS_CHUNK_SIZE; i++) {
+                slot = &c->slot[i];
+                if(was_locked(&slot->lock) ||
+                        (slot->inode && slot->inode->lost))
+                    slot->inode = NULL;
+            }
+        if(budget)
+            budget_child(true);
+        return;
+    }
+    pthread_mutex_init(&fd_chunk_lock, NULL);
+    pthread_mutex_init(&budget_lock, NULL);
+    for(c = fd_chunk_list; c; c = c->next)
+        for(i = 0; i < FDS_CHUNK_SIZE; i++)
+            pthread_mutex_init(&c->slot[i].lock, NULL);
+    /* The interrupted hook may hold a lock of the registry, which is not
+     * ours to reset, so the child tracks its files on its own. */
+    for(i = 0; i < INODE_BUCKETS; i++) {
+        pthread_mutex_init(&inodes[i].lock, NULL);
+        for(inode = inodes[i].head; inode; inode = inode->next) {
+            pthread_mutex_init(&inode->lock, NULL);
+            inode->shared = 0;
+        }
+    }
+    if(budget)
+        budget_child(false);
+}
+
+/* Replace the chunk directory with one that has room for chunk i, twice
+ * as large as the old one (or more), and return it; NULL if there is no
+ * memory. Called with fd_chunk_lock held, or from init(). */
+static struct fd_dir *grow_dir(struct fd_dir *old, int i)
+{
+    struct fd_dir *dir;
+    int n = old ? old->nr_chunks * 2 : FDS_DIR_MIN;
+    int max = (max_fds - 1) / FDS_CHUNK_SIZE + 1;
+
+    while(n <= i)
+        n *= 2;
+    if(n > max)
+        n = max;
+    if((dir = calloc(1, sizeof(*dir) + n * sizeof(dir->chunk[0]))) == NULL)
+        return NULL;
+    dir->prev = old;
+    dir->nr_chunks = n;
+    if(old)
+        memcpy(dir->chunk, old->chunk, old->nr_chunks * sizeof(old->chunk[0]));
+    __atomic_store_n(&fds, dir, __ATOMIC_RELEASE);
+    return dir;
 }
 
-static void init_mutexes(void)
+static struct fd_chunk *alloc_chunk(void)
 {
     int i;
-    pthread_mutex_init(&fds_iter_lock, NULL);
-    pthread_mutex_lock(&fds_iter_lock);
-    fds_lock = malloc(max_fds * sizeof(*fds_lock));
-    assert(fds_lock != NULL);
-    for(i = 0; i < max_fds; i++) {
-        pthread_mutex_init(&fds_lock[i], NULL);
+    struct fd_chunk *chunk;
+
+    chunk = malloc(sizeof(*chunk));
+    if(chunk == NULL)
+        return NULL;
+    for(i = 0; i < FDS_CHUNK_SIZE; i++) {
+        pthread_mutex_init(&chunk->slot[i].lock, NULL);
+        chunk->slot[i].inode = NULL;
+    }
+    return chunk;
+}
+
+static struct inode_bucket *inode_bucket(dev_t dev, ino_t ino)
+{
+    return &inodes[(inode_hash(dev, ino) >> 32) % INODE_BUCKETS];
+}
+
+/* Take a reference to the record for the inode, if the file is tracked
+ * already. If it is to be flushed completely now, it will be. */
+static struct tracked_inode *get_inode(dev_t dev, ino_t ino, bool flush)
+{
+    struct inode_bucket *b = inode_bucket(dev, ino);
+    struct tracked_inode *inode;
+
+    pthread_mutex_lock(&b->lock);
+    for(inode = b->head; inode; inode = inode->next)
+        if(inode->dev == dev && inode->ino == ino)
+            break;
+    if(inode) {
+        inode->refs++;
+        if(flush) {
+            pthread_mutex_lock(&inode->lock);
+            inode->pi.flushall = 1;
+            pthread_mutex_unlock(&inode->lock);
+        }
+    }
+    pthread_mutex_unlock(&b->lock);
+    return inode;
+}
+
+static void free_inode(struct tracked_inode *inode)
+{
+    if(inode->budget_fd != -1)
+        _original_close(inode->budget_fd);
+    free(inode->extents);
+    free_pageinfo(&inode->pi);
+    pthread_mutex_destroy(&inode->lock);
+    free(inode);
+}
+
+/* Add a new record with one reference. If another thread has added one for
+ * the same inode in the meantime, the new one is freed and that one is used
+ * instead. */
+static struct tracked_inode *add_inode(struct tracked_inode *new)
+{
+    struct inode_bucket *b = inode_bucket(new->dev, new->ino);
+    struct tracked_inode *inode;
+
+    pthread_mutex_lock(&b->lock);
+    for(inode = b->head; inode; inode = inode->next)
+        if(inode->dev == new->dev && inode->ino == new->ino)
+            break;
+    if(inode) {
+        inode->refs++;
+    } else {
+        new->next = b->head;
+        b->head = new;
+    }
+    pthread_mutex_unlock(&b->lock);
+
+    if(inode == NULL)
+        return new;
+    if(new->shared)
+        registry_release(new->shared);
+    free_inode(new);
+    return inode;
+}
+
+/* Drop a reference. Returns true if it was the last one; the caller then
+ * owns the record, which is no longer in the table, unless extents of it
+ * are charged to the budget (the caller holds budget_lock then). */
+static bool put_inode(struct tracked_inode *inode)
+{
+    struct inode_bucket *b = inode_bucket(inode->dev, inode->ino);
+    struct tracked_inode **p;
+    bool last;
+
+    pthread_mutex_lock(&b->lock);
+    if((last = --inode->refs == 0) && inode->nr_charged == 0) {
+        for(p = &b->head; *p != inode; p = &(*p)->next)
+            ;
+        *p = inode->next;
+    }
+    pthread_mutex_unlock(&b->lock);
+    return last;
+}
+
+/* Look up the slot for fd and return it with its lock held. If the chunk
+ * the fd belongs to has not been allocated yet, it is allocated if create is
+ * set; otherwise, the fd cannot be tracked and NULL is returned. */
+static struct fd_slot *lock_slot(int fd, bool create)
+{
+    int observed;
+    struct fds_ref *ref;
+    struct fd_dir *dir;
+    struct fd_chunk *chunk;
+    struct fd_slot *slot;
+    int i = fd >> FDS_CHUNK_SHIFT;
+
+    if(fd < 0 || fd >= max_fds || fds == NULL || in_slot)
+        return NULL;
+    in_slot = 1;
+
+    /* This pairs with the store to fds_shutdown in destroy(): either we see
+     * the flag, or destroy() sees our reference and waits for us. */
+    ref = &fds_refs[fd % FDS_REF_STRIPES];
+    __atomic_add_fetch(&ref->count, 1, __ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&fds_shutdown, __ATOMIC_SEQ_CST))
+        goto fail;
+
+    dir = __atomic_load_n(&fds, __ATOMIC_ACQUIRE);
+    chunk = i < dir->nr_chunks ?
+        __atomic_load_n(&dir->chunk[i], __ATOMIC_ACQUIRE) : NULL;
+    if(chunk == NULL) {
+        if(!create)
+            goto fail;
+        pthread_mutex_lock(&fd_chunk_lock);
+        /* Another thread may have been faster. */
+        dir = fds;
+        if(i >= dir->nr_chunks)
+            dir = grow_dir(dir, i);
+        chunk = dir ? dir->chunk[i] : NULL;
+        if(dir && chunk == NULL && (chunk = alloc_chunk()) != NULL) {
+            chunk->next = fd_chunk_list;
+            fd_chunk_list = chunk;
+            __atomic_store_n(&dir->chunk[i], chunk, __ATOMIC_RELEASE);
+        }
+        pthread_mutex_unlock(&fd_chunk_lock);
+        if(chunk == NULL)
+            goto fail;
+    }
+    slot = &chunk->slot[fd & (FDS_CHUNK_SIZE - 1)];
+    pthread_mutex_lock(&slot->lock);
+
+    observed = __atomic_load_n(&max_fd_observed, __ATOMIC_RELAXED);
+    while(fd > observed && !__atomic_compare_exchange_n(&max_fd_observed,
+                &observed, fd, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+
+    return slot;
+
+    fail:
+    __atomic_sub_fetch(&ref->count, 1, __ATOMIC_RELEASE);
+    in_slot = 0;
+    return NULL;
+}
+
+static void unlock_slot(int fd, struct fd_slot *slot)
+{
+    pthread_mutex_unlock(&slot->lock);
+    __atomic_sub_fetch(&fds_refs[fd % FDS_REF_STRIPES].count, 1,
+            __ATOMIC_RELEASE);
+    in_slot = 0;
+}
+
+/* Wait (for a bounded amount of time) until no thread holds a reference to
+ * the fd table any more. Returns false if some thread still does, e.g.
+ * because we are exiting from a signal handler that interrupted a hook. */
+static bool wait_for_fds_users(void)
+{
+    int i, tries;
+    struct timespec delay = { 0, 1000 * 1000 };
+
+    for(tries = 0; tries < 100; tries++) {
+        for(i = 0; i < FDS_REF_STRIPES; i++)
+            if(__atomic_load_n(&fds_refs[i].count, __ATOMIC_SEQ_CST) != 0)
+                break;
+        if(i == FDS_REF_STRIPES)
+            return true;
+        nanosleep(&delay, NULL);
     }
-    pthread_mutex_unlock(&fds_iter_lock);
+    return false;
 }
 
 static void init_debugging(void)
@@ -189,7 +834,32 @@ static void handle_stdout(void)
     fd = fcntl_dupfd(STDOUT_FILENO, 23);
     if(fd == -1)
         return;
-    store_pageinfo(fd);
+    store_pageinfo(fd, NULL, -1);
+}
+
+/* If we were exec'd by a process of the tree, it held the files it had
+ * open. Track those of them whose fds we inherited, taking over its
+ * references, and drop the rest of what it held. */
+static void adopt_inherited(void)
+{
+    DIR *dir;
+    struct dirent *de;
+    struct stat st;
+    int fd;
+
+    if((dir = opendir("/proc/self/fd")) != NULL) {
+        while((de = readdir(dir)) != NULL) {
+            if(de->d_name[0] == '.' || (fd = atoi(de->d_name)) == dirfd(dir))
+                continue;
+            if(fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+                    registry_held(st.st_dev, st.st_ino)) {
+                DEBUG("adopt_inherited(fd=%d)\n", fd);
+                store_pageinfo(fd, NULL, -1);
+            }
+        }
+        closedir(dir);
+    }
+    registry_exec();
 }
 
 /* try to advise fds that were not manually closed */
@@ -197,39 +867,49 @@ static void destroy(void)
 {
     int i;
     int max_fd_to_clear;
-    sigset_t mask, old_mask;
+    struct fd_dir *dir;
+    struct fd_chunk *chunk;
+    struct tracked_inode *inode;
+
+    if(fds == NULL)
+        return;
 
     /* There is a race condition here: If something opens files after
      * extracting max_fd_observed, then it is possible we miss cleaning it up
      * in the shutdown path. */
-    pthread_mutex_lock(&fds_iter_lock);
-    max_fd_to_clear = max_fd_observed;
-    pthread_mutex_unlock(&fds_iter_lock);
-
-    /* We block signals here, and then call free_unclaimed_pages in a loop. As
-     * max_fds may be high (millions), it's very wasteful to block signals
-     * repeatedly, so it's done once here. */
-    sigfillset(&mask);
-    sigprocmask(SIG_BLOCK, &mask, &old_mask);
-    for(i = 0; i < max_fd_to_clear; i++) {
-        free_unclaimed_pages(i, false);
-    }
-    sigprocmask(SIG_SETMASK, &old_mask, NULL);
-
-    pthread_mutex_lock(&fds_iter_lock);
-    if(fds_lock == NULL) {
-        pthread_mutex_unlock(&fds_iter_lock);
+    max_fd_to_clear = __atomic_load_n(&max_fd_observed, __ATOMIC_RELAXED);
+
+    /* Chunks that were never allocated are skipped by lock_slot() right
+     * away. */
+    for(i = 0; i <= max_fd_to_clear; i++) {
+        free_unclaimed_pages(i);
+    }
+    async_drain();
+    if(budget)
+        budget_drain();
+
+    /* From now on, lock_slot() refuses to hand out slots. Once all threads
+     * that are still inside a hook have left, it is safe to free the table;
+     * if they don't leave in time, the table is left to the OS. */
+    __atomic_store_n(&fds_shutdown, 1, __ATOMIC_SEQ_CST);
+    stats_dump();
+    trace_flush_all();
+    if(!wait_for_fds_users())
         return;
+
+    while((chunk = fd_chunk_list) != NULL) {
+        fd_chunk_list = chunk->next;
+        free(chunk);
     }
-    for(i = 0; i < max_fds; i++) {
-        pthread_mutex_lock(&fds_lock[i]);
+    while((dir = fds) != NULL) {
+        fds = dir->prev;
+        free(dir);
     }
-    /* We have acquired all locks. It is now safe to delete and free the list. */
-    free(fds);
-    fds = NULL;
-    free(fds_lock);
-    fds_lock = NULL;
-    pthread_mutex_unlock(&fds_iter_lock);
+    for(i = 0; i < INODE_BUCKETS; i++)
+        while((inode = inodes[i].head) != NULL) {
+            inodes[i].head = inode->next;
+            free_inode(inode);
+        }
 }
 
 int open(const char *pathname, int flags, mode_t mode)
@@ -243,7 +923,7 @@ int open(const char *pathname, int flags, mode_t mode)
     if((fd = _original_open(pathname, flags, mode)) != -1) {
         DEBUG("open(pathname=%s, flags=0x%x, mode=0%o) = %d\n",
             pathname, flags, mode, fd);
-        store_pageinfo(fd);
+        store_pageinfo(fd, pathname, flags);
     }
     return fd;
 }
@@ -259,7 +939,7 @@ int open64(const char *pathname, int flags, mode_t mode)
     DEBUG("open64(pathname=%s, flags=0x%x, mode=0%o)\n", pathname, flags, mode);
 
     if((fd = _original_open64(pathname, flags, mode)) != -1)
-        store_pageinfo(fd);
+        store_pageinfo(fd, pathname, flags);
     return fd;
 }
 
@@ -274,7 +954,7 @@ int creat(const char *pathname, int flags, mode_t mode)
     DEBUG("creat(pathname=%s, flags=0x%x, mode=0%o)\n", pathname, flags, mode);
 
     if((fd = _original_creat(pathname, flags, mode)) != -1)
-        store_pageinfo(fd);
+        store_pageinfo(fd, pathname, fopen_flags("w"));
     return fd;
 }
 
@@ -289,7 +969,7 @@ int creat64(const char *pathname, int flags, mode_t mode)
     DEBUG("creat64(pathname=%s, flags=0x%x, mode=0%o)\n", pathname, flags, mode);
 
     if((fd = _original_creat64(pathname, flags, mode)) != -1)
-        store_pageinfo(fd);
+        store_pageinfo(fd, pathname, fopen_flags("w"));
     return fd;
 }
 
@@ -304,7 +984,7 @@ int openat(int dirfd, const char *pathname, int flags, mode_t mode)
     DEBUG("openat(dirfd=%d, pathname=%s, flags=0x%x, mode=0%o)\n", dirfd, pathname, flags, mode);
 
     if((fd = _original_openat(dirfd, pathname, flags, mode)) != -1)
-        store_pageinfo(fd);
+        store_pageinfo(fd, pathname, flags);
     return fd;
 }
 
@@ -319,7 +999,7 @@ int openat64(int dirfd, const char *pathname, int flags, mode_t mode)
     DEBUG("openat64(dirfd=%d, pathname=%s, flags=0x%x, mode=0%o)\n", dirfd, pathname, flags, mode);
 
     if((fd = _original_openat64(dirfd, pathname, flags, mode)) != -1)
-        store_pageinfo(fd);
+        store_pageinfo(fd, pathname, flags);
     return fd;
 }
 
@@ -333,8 +1013,10 @@ int dup(int oldfd)
 
     DEBUG("dup(oldfd=%d)\n", oldfd);
 
-    if((fd = _original_dup(oldfd)) != -1)
-        store_pageinfo(fd);
+    if((fd = _original_dup(oldfd)) != -1) {
+        seen_pos(oldfd, -1, true);
+        store_pageinfo(fd, NULL, -1);
+    }
     return fd;
 }
 
@@ -346,7 +1028,7 @@ int dup2(int oldfd, int newfd)
      * once dup2 is invoked. So now is the last chance to mark the
      * pages as "DONTNEED" */
     if(valid_fd(newfd))
-        free_unclaimed_pages(newfd, true);
+        free_unclaimed_pages(newfd);
 
     if(!_original_dup2)
         _original_dup2 = (int (*)(int, int)) dlsym(RTLD_NEXT, "dup2");
@@ -354,18 +1036,91 @@ int dup2(int oldfd, int newfd)
 
     DEBUG("dup2(oldfd=%d, newfd=%d)\n", oldfd, newfd);
 
-    if((ret = _original_dup2(oldfd, newfd)) != -1)
-        store_pageinfo(newfd);
+    if((ret = _original_dup2(oldfd, newfd)) != -1) {
+        seen_pos(oldfd, -1, true);
+        store_pageinfo(newfd, NULL, -1);
+    }
+    return ret;
+}
+
+int dup3(int oldfd, int newfd, int flags)
+{
+    int ret;
+
+    /* see dup2() */
+    if(valid_fd(newfd) && oldfd != newfd)
+        free_unclaimed_pages(newfd);
+
+    if(!_original_dup3)
+        _original_dup3 = (int (*)(int, int, int)) dlsym(RTLD_NEXT, "dup3");
+    assert(_original_dup3 != NULL);
+
+    DEBUG("dup3(oldfd=%d, newfd=%d, flags=0x%x)\n", oldfd, newfd, flags);
+
+    if((ret = _original_dup3(oldfd, newfd, flags)) != -1) {
+        seen_pos(oldfd, -1, true);
+        store_pageinfo(newfd, NULL, -1);
+    }
     return ret;
 }
 
+/* Of the fcntl() commands, only those that duplicate fd matter here. The
+ * argument is passed on as a pointer, which holds an int as well, like
+ * libc's own wrappers do. */
+static int do_fcntl(int (*orig)(int, int, ...), int fd, int cmd, void *arg)
+{
+    int ret;
+
+    if((ret = orig(fd, cmd, arg)) != -1 && fcntl_is_dupfd(cmd)) {
+        DEBUG("fcntl(fd=%d, cmd=%d) = %d\n", fd, cmd, ret);
+        seen_pos(fd, -1, true);
+        store_pageinfo(ret, NULL, -1);
+    }
+    return ret;
+}
+
+int fcntl(int fd, int cmd, ...)
+{
+    va_list ap;
+    void *arg;
+
+    va_start(ap, cmd);
+    arg = va_arg(ap, void *);
+    va_end(ap);
+
+    if(!_original_fcntl)
+        _original_fcntl = (int (*)(int, int, ...)) dlsym(RTLD_NEXT, "fcntl");
+    assert(_original_fcntl != NULL);
+
+    return do_fcntl(_original_fcntl, fd, cmd, arg);
+}
+
+/* what fcntl() is called as with 64-bit offsets on newer glibc; not every
+ * libc has it, so it isn't looked up in init() */
+int fcntl64(int fd, int cmd, ...)
+{
+    va_list ap;
+    void *arg;
+
+    va_start(ap, cmd);
+    arg = va_arg(ap, void *);
+    va_end(ap);
+
+    if(!_original_fcntl64)
+        _original_fcntl64 = (int (*)(int, int, ...)) dlsym(RTLD_NEXT, "fcntl64");
+    if(!_original_fcntl64)
+        return fcntl(fd, cmd, arg);
+
+    return do_fcntl(_original_fcntl64, fd, cmd, arg);
+}
+
 int close(int fd)
 {
     if(!_original_close)
         _original_close = (int (*)(int)) dlsym(RTLD_NEXT, "close");
     assert(_original_close != NULL);
 
-    free_unclaimed_pages(fd, true);
+    free_unclaimed_pages(fd);
 
     DEBUG("close(%d)\n", fd);
     return _original_close(fd);
@@ -383,8 +1138,10 @@ FILE *fopen(const char *path, const char *mode)
     DEBUG("fopen(path=%s, mode=%s)\n", path, mode);
 
     if((fp = _original_fopen(path, mode)) != NULL)
-        if((fd = fileno(fp)) != -1)
-            store_pageinfo(fd);
+        if((fd = fileno(fp)) != -1) {
+            store_pageinfo(fd, path, fopen_flags(mode));
+            seen_pos(fd, -1, true);  /* stdio moves it unseen */
+        }
 
     return fp;
 }
@@ -402,12 +1159,29 @@ FILE *fopen64(const char *path, const char *mode)
     DEBUG("fopen64(path=%s, mode=%s)\n", path, mode);
 
     if((fp = _original_fopen64(path, mode)) != NULL)
-        if((fd = fileno(fp)) != -1)
-            store_pageinfo(fd);
+        if((fd = fileno(fp)) != -1) {
+            store_pageinfo(fd, path, fopen_flags(mode));
+            seen_pos(fd, -1, true);  /* stdio moves it unseen */
+        }
 
     return fp;
 }
 
+FILE *fdopen(int fd, const char *mode)
+{
+    FILE *fp;
+
+    if(!_original_fdopen)
+        _original_fdopen = (FILE *(*)(int, const char *)) dlsym(RTLD_NEXT, "fdopen");
+    assert(_original_fdopen != NULL);
+
+    DEBUG("fdopen(fd=%d, mode=%s)\n", fd, mode);
+
+    if((fp = _original_fdopen(fd, mode)) != NULL)
+        seen_pos(fd, -1, true);  /* stdio moves it unseen */
+    return fp;
+}
+
 int fclose(FILE *fp)
 {
     if(!_original_fclose)
@@ -415,7 +1189,7 @@ int fclose(FILE *fp)
     assert(_original_fclose != NULL);
 
     if(_original_fclose) {
-        free_unclaimed_pages(fileno(fp), true);
+        free_unclaimed_pages(fileno(fp));
         return _original_fclose(fp);
     }
 
@@ -423,113 +1197,1252 @@ int fclose(FILE *fp)
     return EOF;
 }
 
-static void store_pageinfo(int fd)
+static size_t iov_len(const struct iovec *iov, int iovcnt)
+{
+    int i;
+    size_t len = 0;
+    for(i = 0; i < iovcnt; i++)
+        len += iov[i].iov_len;
+    return len;
+}
+
+ssize_t read(int fd, void *buf, size_t count)
+{
+    ssize_t ret;
+
+    if(!_original_read)
+        _original_read = (ssize_t (*)(int, void *, size_t)) dlsym(RTLD_NEXT, "read");
+    assert(_original_read != NULL);
+
+    if(lazy)
+        touch_pageinfo(fd, -1, count);
+    if((ret = _original_read(fd, buf, count)) > 0 && dropbehind)
+        drop_behind(fd, -1, ret, false);
+    if(lazy && ret != (ssize_t)count)
+        seen_pos(fd, -1, false);  /* it moved less than expected */
+    if(ret > 0 && budget)
+        budget_touch(fd, -1, ret, false);
+    return ret;
+}
+
+ssize_t write(int fd, const void *buf, size_t count)
+{
+    ssize_t ret;
+
+    if(!_original_write)
+        _original_write = (ssize_t (*)(int, const void *, size_t)) dlsym(RTLD_NEXT, "write");
+    assert(_original_write != NULL);
+
+    if(lazy)
+        touch_pageinfo(fd, -1, count);
+    if((ret = _original_write(fd, buf, count)) > 0 && dropbehind)
+        drop_behind(fd, -1, ret, true);
+    if(lazy && ret != (ssize_t)count)
+        seen_pos(fd, -1, false);  /* it moved less than expected */
+    if(ret > 0 && writebehind)
+        write_behind(fd, -1, ret);
+    if(ret > 0 && budget)
+        budget_touch(fd, -1, ret, true);
+    return ret;
+}
+
+ssize_t pread(int fd, void *buf, size_t count, off_t offset)
+{
+    ssize_t ret;
+
+    if(!_original_pread)
+        _original_pread = (ssize_t (*)(int, void *, size_t, off_t)) dlsym(RTLD_NEXT, "pread");
+    assert(_original_pread != NULL);
+
+    if(lazy)
+        touch_pageinfo(fd, offset, count);
+    if((ret = _original_pread(fd, buf, count, offset)) > 0 && dropbehind)
+        drop_behind(fd, offset, ret, false);
+    if(ret > 0 && budget)
+        budget_touch(fd, offset, ret, false);
+    return ret;
+}
+
+ssize_t pwrite(int fd, const void *buf, size_t count, off_t offset)
+{
+    ssize_t ret;
+
+    if(!_original_pwrite)
+        _original_pwrite = (ssize_t (*)(int, const void *, size_t, off_t)) dlsym(RTLD_NEXT, "pwrite");
+    assert(_original_pwrite != NULL);
+
+    if(lazy)
+        touch_pageinfo(fd, offset, count);
+    if((ret = _original_pwrite(fd, buf, count, offset)) > 0 && dropbehind)
+        drop_behind(fd, offset, ret, true);
+    if(ret > 0 && writebehind)
+        write_behind(fd, offset, ret);
+    if(ret > 0 && budget)
+        budget_touch(fd, offset, ret, true);
+    return ret;
+}
+
+ssize_t pread64(int fd, void *buf, size_t count, off64_t offset)
+{
+    ssize_t ret;
+
+    if(!_original_pread64)
+        _original_pread64 = (ssize_t (*)(int, void *, size_t, off64_t)) dlsym(RTLD_NEXT, "pread64");
+    assert(_original_pread64 != NULL);
+
+    if(lazy)
+        touch_pageinfo(fd, offset, count);
+    if((ret = _original_pread64(fd, buf, count, offset)) > 0 && dropbehind)
+        drop_behind(fd, offset, ret, false);
+    if(ret > 0 && budget)
+        budget_touch(fd, offset, ret, false);
+    return ret;
+}
+
+ssize_t pwrite64(int fd, const void *buf, size_t count, off64_t offset)
+{
+    ssize_t ret;
+
+    if(!_original_pwrite64)
+        _original_pwrite64 = (ssize_t (*)(int, const void *, size_t, off64_t)) dlsym(RTLD_NEXT, "pwrite64");
+    assert(_original_pwrite64 != NULL);
+
+    if(lazy)
+        touch_pageinfo(fd, offset, count);
+    if((ret = _original_pwrite64(fd, buf, count, offset)) > 0 && dropbehind)
+        drop_behind(fd, offset, ret, true);
+    if(ret > 0 && writebehind)
+        write_behind(fd, offset, ret);
+    if(ret > 0 && budget)
+        budget_touch(fd, offset, ret, true);
+    return ret;
+}
+
+ssize_t readv(int fd, const struct iovec *iov, int iovcnt)
+{
+    ssize_t ret;
+
+    if(!_original_readv)
+        _original_readv = (ssize_t (*)(int, const struct iovec *, int)) dlsym(RTLD_NEXT, "readv");
+    assert(_original_readv != NULL);
+
+    if(lazy)
+        touch_pageinfo(fd, -1, iov_len(iov, iovcnt));
+    if((ret = _original_readv(fd, iov, iovcnt)) > 0 && dropbehind)
+        drop_behind(fd, -1, ret, false);
+    if(lazy && ret != (ssize_t)iov_len(iov, iovcnt))
+        seen_pos(fd, -1, false);  /* it moved less than expected */
+    if(ret > 0 && budget)
+        budget_touch(fd, -1, ret, false);
+    return ret;
+}
+
+ssize_t writev(int fd, const struct iovec *iov, int iovcnt)
+{
+    ssize_t ret;
+
+    if(!_original_writev)
+        _original_writev = (ssize_t (*)(int, const struct iovec *, int)) dlsym(RTLD_NEXT, "writev");
+    assert(_original_writev != NULL);
+
+    if(lazy)
+        touch_pageinfo(fd, -1, iov_len(iov, iovcnt));
+    if((ret = _original_writev(fd, iov, iovcnt)) > 0 && dropbehind)
+        drop_behind(fd, -1, ret, true);
+    if(lazy && ret != (ssize_t)iov_len(iov, iovcnt))
+        seen_pos(fd, -1, false);  /* it moved less than expected */
+    if(ret > 0 && writebehind)
+        write_behind(fd, -1, ret);
+    if(ret > 0 && budget)
+        budget_touch(fd, -1, ret, true);
+    return ret;
+}
+
+off_t lseek(int fd, off_t offset, int whence)
+{
+    off_t ret;
+
+    if(!_original_lseek)
+        _original_lseek = (off_t (*)(int, off_t, int)) dlsym(RTLD_NEXT, "lseek");
+    assert(_original_lseek != NULL);
+
+    if((ret = _original_lseek(fd, offset, whence)) != -1)
+        seen_pos(fd, ret, false);
+    return ret;
+}
+
+off64_t lseek64(int fd, off64_t offset, int whence)
 {
-    sigset_t mask, old_mask;
+    off64_t ret;
+
+    if(!_original_lseek64)
+        _original_lseek64 = (off64_t (*)(int, off64_t, int)) dlsym(RTLD_NEXT, "lseek64");
+    assert(_original_lseek64 != NULL);
+
+    if((ret = _original_lseek64(fd, offset, whence)) != -1)
+        seen_pos(fd, ret, false);
+    return ret;
+}
+
+/* What moves through these is not accounted (as with mmap, the pages are
+ * dropped at close), but they move the file position of each fd they are
+ * not given an offset for, so the slots can't know where that is. */
+ssize_t sendfile(int out_fd, int in_fd, off_t *offset, size_t count)
+{
+    ssize_t ret;
+
+    if(!_original_sendfile)
+        _original_sendfile = (ssize_t (*)(int, int, off_t *, size_t)) dlsym(RTLD_NEXT, "sendfile");
+    assert(_original_sendfile != NULL);
+
+    if((ret = _original_sendfile(out_fd, in_fd, offset, count)) > 0) {
+        seen_pos(out_fd, -1, false);
+        if(offset == NULL)
+            seen_pos(in_fd, -1, false);
+    }
+    return ret;
+}
+
+/* not in every libc, so it isn't looked up in init() */
+ssize_t sendfile64(int out_fd, int in_fd, off64_t *offset, size_t count)
+{
+    ssize_t ret;
+
+    if(!_original_sendfile64)
+        _original_sendfile64 = (ssize_t (*)(int, int, off64_t *, size_t)) dlsym(RTLD_NEXT, "sendfile64");
+    assert(_original_sendfile64 != NULL);
+
+    if((ret = _original_sendfile64(out_fd, in_fd, offset, count)) > 0) {
+        seen_pos(out_fd, -1, false);
+        if(offset == NULL)
+            seen_pos(in_fd, -1, false);
+    }
+    return ret;
+}
+
+ssize_t splice(int fd_in, off64_t *off_in, int fd_out, off64_t *off_out,
+    size_t len, unsigned int flags)
+{
+    ssize_t ret;
+
+    if(!_original_splice)
+        _original_splice = (ssize_t (*)(int, off64_t *, int, off64_t *, size_t, unsigned int)) dlsym(RTLD_NEXT, "splice");
+    assert(_original_splice != NULL);
+
+    if((ret = _original_splice(fd_in, off_in, fd_out, off_out, len, flags)) > 0) {
+        if(off_in == NULL)
+            seen_pos(fd_in, -1, false);
+        if(off_out == NULL)
+            seen_pos(fd_out, -1, false);
+    }
+    return ret;
+}
+
+/* not in every libc, so it isn't looked up in init() */
+ssize_t copy_file_range(int fd_in, off64_t *off_in, int fd_out,
+    off64_t *off_out, size_t len, unsigned int flags)
+{
+    ssize_t ret;
+
+    if(!_original_copy_file_range)
+        _original_copy_file_range = (ssize_t (*)(int, off64_t *, int, off64_t *, size_t, unsigned int)) dlsym(RTLD_NEXT, "copy_file_range");
+    assert(_original_copy_file_range != NULL);
+
+    if((ret = _original_copy_file_range(fd_in, off_in, fd_out, off_out, len, flags)) > 0) {
+        if(off_in == NULL)
+            seen_pos(fd_in, -1, false);
+        if(off_out == NULL)
+            seen_pos(fd_out, -1, false);
+    }
+    return ret;
+}
+
+/* Decide what to do with fd according to the policy file, if any. path and
+ * flags are what the file was opened with, if known (NULL and -1 if not). */
+static enum policy_action check_policy(int fd, const char *path, int flags)
+{
+    int needs;
+    off_t size = 0;
+    struct stat st;
+    char proc[32], buf[PATH_MAX];
+    ssize_t n;
+
+    if((needs = policy_needs()) == 0)
+        return POLICY_TRACK;
+
+    /* Relative paths (and fds we got from dup) are resolved by the kernel,
+     * which costs a syscall, but only when there is a policy. */
+    if((needs & POLICY_NEEDS_PATH) && (path == NULL || path[0] != '/')) {
+        snprintf(proc, sizeof(proc), "/proc/self/fd/%d", fd);
+        if((n = readlink(proc, buf, sizeof(buf) - 1)) != -1) {
+            buf[n] = '\0';
+            path = buf;
+        }
+    }
+    if((needs & POLICY_NEEDS_SIZE) && fstat(fd, &st) != -1)
+        size = st.st_size;
+    if((needs & POLICY_NEEDS_FLAGS) && flags == -1)
+        flags = fcntl_getfl(fd);
+
+    return policy_match(path, size, flags);
+}
+
+static void store_pageinfo(int fd, const char *path, int flags)
+{
+    struct fd_slot *slot;
+    struct tracked_inode *inode;
+    struct file_pageinfo *pi;
+    enum policy_action action;
+    struct stat st;
+    bool flush;
+    uint64_t start;
 
     if(fd >= max_fds)
         return;
+    start = stats_start();
 
     /* We might know something about this fd already, so assume we have missed
      * it being closed. */
-    free_unclaimed_pages(fd, true);
-
-    sigfillset(&mask);
-    sigprocmask(SIG_BLOCK, &mask, &old_mask);
+    free_unclaimed_pages(fd);
 
-    pthread_mutex_lock(&fds_iter_lock);
-    if(fds_lock == NULL) {
-        pthread_mutex_unlock(&fds_iter_lock);
-        return;
+    if((action = check_policy(fd, path, flags)) == POLICY_IGNORE) {
+        DEBUG("store_pageinfo(fd=%d): ignored by policy\n", fd);
+        TRACE(TRACE_IGNORE, fd, 0, 0);
+        goto done;
     }
-    pthread_mutex_lock(&fds_lock[fd]);
-    if(fd > max_fd_observed)
-        max_fd_observed = fd;
-    pthread_mutex_unlock(&fds_iter_lock);
+
+    /* Only regular files can be scanned; anything else can only be
+     * flushed completely. */
+    flush = flushall || action == POLICY_FLUSHALL;
+    if(fstat(fd, &st) == -1 || (!S_ISREG(st.st_mode) && !flush))
+        goto done;
+
+    if((slot = lock_slot(fd, true)) == NULL)
+        goto done;
 
     /* Hint we'll be using this file only once;
      * the Linux kernel will currently ignore this */
     fadv_noreuse(fd, 0, 0);
 
-    fds[fd].fd = fd;
-    if(flushall)
+    slot->behind = 0;
+    slot->progress = 0;
+    slot->wb_done = 0;
+    slot->wb_submitted = 0;
+    slot->wb_progress = 0;
+    slot->budget_last = 0;
+    slot->pos = 0;
+    /* the position of a dup()ed fd is that of the original */
+    slot->pos_shared = flags_append(flags);
+    slot->fork_gen = __atomic_load_n(&fork_gen, __ATOMIC_RELAXED);
+    stats_add(STAT_FILES_TRACKED, 1);
+    TRACE(TRACE_OPEN, fd, 0, 0);
+
+    /* If the file is open already (or kept for the budget), what it had in
+     * the cache was recorded back then; pages read through the other fds
+     * since then are not ours to keep. */
+    if((slot->inode = get_inode(st.st_dev, st.st_ino, flush)) != NULL) {
+        DEBUG("store_pageinfo(fd=%d): file is open already, %d fds\n",
+            fd, slot->inode->refs);
+        stats_add(STAT_FILES_SHARED, 1);
         goto out;
+    }
 
-    if(!fd_get_pageinfo(fd, &fds[fd])) {
-        fds[fd].fd = -1;
+    if((inode = calloc(1, sizeof(*inode))) == NULL)
         goto out;
+    pthread_mutex_init(&inode->lock, NULL);
+    inode->budget_fd = -1;
+    inode->dev = st.st_dev;
+    inode->ino = st.st_ino;
+    inode->refs = 1;
+    pi = &inode->pi;
+    pi->fd = fd;
+    pi->flushall = flush;
+
+    /* Maybe another process in the tree has scanned the file already. */
+    if(registry_enabled) {
+        switch(registry_acquire(st.st_dev, st.st_ino, flush, pi,
+                    &inode->shared)) {
+        case REGISTRY_COPIED:
+            DEBUG("store_pageinfo(fd=%d): found in the registry, pages in "
+                "cache: %zd/%zd\n", fd, pi->nr_pages_cached, pi->nr_pages);
+            stats_add(STAT_REGISTRY_HITS, 1);
+            goto add;
+        case REGISTRY_SCAN:
+            break;
+        case REGISTRY_FULL:
+            inode->shared = 0;
+            break;
+        }
+    }
+    if(pi->flushall)
+        goto publish;
+
+    if(lazy) {
+        if(!fd_get_pageinfo_lazy(fd, pi, lazy))
+            goto fail;
+        goto add;
     }
 
+    if(!fd_get_pageinfo(fd, pi))
+        goto fail;
+    stats_add(STAT_PAGES_CACHED, pi->nr_pages_cached);
+    TRACE(TRACE_PAGEINFO, fd, pi->nr_pages_cached, pi->nr_pages);
+
     DEBUG("store_pageinfo(fd=%d): pages in cache: %zd/%zd (%.1f%%)  [filesize=%.1fK, "
-            "pagesize=%dK]\n", fd, fds[fd].nr_pages_cached, fds[fd].nr_pages,
-             fds[fd].nr_pages == 0 ? 0 : (100.0 * fds[fd].nr_pages_cached / fds[fd].nr_pages),
-             1.0 * fds[fd].size / 1024, (int) PAGESIZE / 1024);
+            "pagesize=%dK]\n", fd, pi->nr_pages_cached, pi->nr_pages,
+             pi->nr_pages == 0 ? 0 : (100.0 * pi->nr_pages_cached / pi->nr_pages),
+             1.0 * pi->size / 1024, (int) PAGESIZE / 1024);
+
+    publish:
+    if(inode->shared)
+        registry_publish(inode->shared, pi);
+
+    add:
+    slot->inode = add_inode(inode);
 
     out:
-    pthread_mutex_unlock(&fds_lock[fd]);
-    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+    unlock_slot(fd, slot);
 
+    done:
+    stats_stop(TIMER_STORE_PAGEINFO, start);
     return;
+
+    fail:
+    if(inode->shared)
+        registry_release(inode->shared);
+    free_inode(inode);
+    goto out;
 }
 
-static void free_unclaimed_pages(int fd, bool block_signals)
+static void free_unclaimed_pages(int fd)
 {
-    struct stat st;
-    sigset_t mask, old_mask;
+    struct fd_slot *slot;
+    struct tracked_inode *inode;
+    struct byterange *ranges = NULL;
+    size_t i, nr_ranges = 0;
+    bool last, kept;
+    uint64_t start;
 
     if(fd == -1 || fd >= max_fds)
         return;
+    start = stats_start();
 
-    if(block_signals) {
-        sigfillset(&mask);
-        sigprocmask(SIG_BLOCK, &mask, &old_mask);
+    /* If the fd's chunk was never allocated, we don't know anything about
+     * it, so there is nothing to do. */
+    if((slot = lock_slot(fd, false)) == NULL)
+        goto done;
+    if((inode = slot->inode) == NULL)
+        goto out;
+    slot->inode = NULL;
+
+    TRACE(TRACE_CLOSE, fd, 0, 0);
+    /* In budget mode, a file whose extents are charged stays in the table
+     * after its last close; from then on, the record is the sweep's. */
+    if(budget)
+        pthread_mutex_lock(&budget_lock);
+    last = put_inode(inode);
+    if((kept = last && inode->nr_charged > 0))
+        nr_ranges = budget_close(fd, inode, &ranges);
+    if(budget)
+        pthread_mutex_unlock(&budget_lock);
+    for(i = 0; i < nr_ranges; i++) {
+        DEBUG("fadv_dontneed(fd=%d, from=%lld, len=%lld)\n", fd,
+              (long long)ranges[i].pos, (long long)ranges[i].len);
+        fadv_dontneed(fd, ranges[i].pos, ranges[i].len, nr_fadvise);
+    }
+    free(ranges);
+
+    /* The pages are dropped once the last fd for the file is closed, in
+     * this process or, with a registry, in the whole process tree. */
+    if(last && !kept) {
+        if(!inode->shared || registry_release(inode->shared)) {
+            if(!async_size || !async_enqueue(fd, &inode->pi))
+                evict(fd, &inode->pi);
+            free_inode(inode);
+            goto out;
+        }
+        free_inode(inode);
     }
 
-    pthread_mutex_lock(&fds_iter_lock);
-    if(fds_lock == NULL) {
-        pthread_mutex_unlock(&fds_iter_lock);
-        return;
+    /* What was written through this fd has to be written back now, as the
+     * fd that is closed last may not be writable. */
+    DEBUG("free_unclaimed_pages(fd=%d): file is %s\n", fd,
+          kept ? "kept for the budget" : "still open");
+    if(writebehind)
+        sync_range_if_writable(fd);
+    else
+        sync_if_writable(fd);
+
+    out:
+    unlock_slot(fd, slot);
+
+    done:
+    stats_stop(TIMER_FREE_UNCLAIMED, start);
+}
+
+/* Under some memory pressure: drop only a share (in permille) of what was
+ * not cached when the file was opened, from its start on. That is what a
+ * sequential reader was done with first. */
+static void evict_share(int fd, struct file_pageinfo *pi, off_t size,
+    unsigned int share)
+{
+    struct byterange *br;
+    off_t total = 0, left, len;
+
+    for(br = pi->unmapped; br < pi->unmapped + pi->nr_unmapped; br++)
+        total += br->len;
+    if(size > pi->size)
+        total += size - pi->size;
+    left = (double)total * share / 1000;
+    left = (left + PAGESIZE - 1) / PAGESIZE * PAGESIZE;
+
+    for(br = pi->unmapped; br < pi->unmapped + pi->nr_unmapped && left > 0;
+            br++) {
+        len = (off_t)br->len < left ? (off_t)br->len : left;
+        DEBUG("fadv_dontneed(fd=%d, from=%zd, len=%lld)\n", fd, br->pos,
+              (long long)len);
+        fadv_dontneed(fd, br->pos, len, nr_fadvise);
+        left -= len;
     }
-    pthread_mutex_lock(&fds_lock[fd]);
-    if(fd > max_fd_observed)
-        max_fd_observed = fd;
-    pthread_mutex_unlock(&fds_iter_lock);
+    if(left > 0 && size > pi->size) {
+        DEBUG("fadv_dontneed(fd=%d, from=%lld, len=%lld [file has grown])\n",
+              fd, (long long)pi->size, (long long)left);
+        fadv_dontneed(fd, pi->size, left, nr_fadvise);
+    }
+}
 
-    if(fds[fd].fd == -1)
+/* Write back the file open as fd and drop the pages pi says were not cached
+ * when it was opened, or, with adaptive eviction, as many of them as memory
+ * pressure calls for. */
+static void evict(int fd, struct file_pageinfo *pi)
+{
+    struct stat st;
+    struct byterange *br;
+    size_t sacrificed;
+    unsigned int share = 1000;
+    uint64_t start = stats_start();
+
+    /* Files to be flushed completely are, regardless. */
+    if(pressure_enabled && !pi->flushall &&
+            (share = pressure_decide()) == 0) {
+        DEBUG("evict(fd=%d): no memory pressure, pages kept\n", fd);
         goto out;
+    }
 
-    sync_if_writable(fd);
+    /* With write-behind, most of the data has been written back already;
+     * there's no need to wait for a journal commit, too. */
+    if(writebehind)
+        sync_range_if_writable(fd);
+    else
+        sync_if_writable(fd);
 
-    if(flushall) {
+    if(pi->flushall) {
         DEBUG("fadv_dontneed(fd=%d, from=0, len=0 [till end])\n", fd);
         fadv_dontneed(fd, 0, 0, nr_fadvise);
-        fds[fd].fd = -1;
         goto out;
     }
 
     if(fstat(fd, &st) == -1)
         goto out;
 
-    struct byterange *br;
-    for(br = fds[fd].unmapped; br; br = br->next) {
+    if(fadvise_gap || max_fadvise) {
+        sacrificed = coalesce_ranges(pi, fadvise_gap, max_fadvise);
+        DEBUG("coalesce_ranges(fd=%d): %zd ranges left, %zd cached pages "
+              "sacrificed\n", fd, pi->nr_unmapped, sacrificed / PAGESIZE);
+        TRACE(TRACE_COALESCE, fd, pi->nr_unmapped, sacrificed / PAGESIZE);
+        stats_add(STAT_PAGES_COALESCED, sacrificed / PAGESIZE);
+    }
+
+    if(share < 1000) {
+        DEBUG("evict(fd=%d): some memory pressure, dropping %u/1000\n", fd,
+              share);
+        evict_share(fd, pi, st.st_size, share);
+        goto out;
+    }
+
+    for(br = pi->unmapped; br < pi->unmapped + pi->nr_unmapped; br++) {
         DEBUG("fadv_dontneed(fd=%d, from=%zd, len=%zd)\n", fd, br->pos, br->len);
         fadv_dontneed(fd, br->pos, br->len, nr_fadvise);
     }
 
     /* Has the file grown bigger? */
-    if(st.st_size > fds[fd].size) {
+    if(st.st_size > pi->size) {
         DEBUG("fadv_dontneed(fd=%d, from=%lld, len=0 [till new end, file has grown])\n",
-              fd, (long long)fds[fd].size);
-        fadv_dontneed(fd, fds[fd].size, 0, nr_fadvise);
+              fd, (long long)pi->size);
+        fadv_dontneed(fd, pi->size, 0, nr_fadvise);
     }
 
-    free_br_list(&fds[fd].unmapped);
-    fds[fd].fd = -1;
+    out:
+    stats_stop(TIMER_EVICT, start);
+}
+
+/* Advise the kernel to drop the byte range [from, to) of the file open as
+ * fd, except for the pages that were already cached when it was opened. */
+static void fadv_dontneed_uncached(int fd, struct file_pageinfo *pi,
+    off_t from, off_t to)
+{
+    off_t start, end;
+    struct byterange *br;
+
+    if(pi->flushall) {
+        DEBUG("fadv_dontneed(fd=%d, from=%lld, len=%lld)\n",
+              fd, (long long)from, (long long)(to - from));
+        fadv_dontneed(fd, from, to - from, nr_fadvise);
+        return;
+    }
+
+    for(br = pi->unmapped; br < pi->unmapped + pi->nr_unmapped; br++) {
+        start = (off_t)br->pos > from ? (off_t)br->pos : from;
+        end = (off_t)(br->pos + br->len) < to ? (off_t)(br->pos + br->len) : to;
+        if(start >= end)
+            continue;
+        DEBUG("fadv_dontneed(fd=%d, from=%lld, len=%lld)\n",
+              fd, (long long)start, (long long)(end - start));
+        fadv_dontneed(fd, start, end - start, nr_fadvise);
+    }
+
+    /* Everything beyond the size at open time is new to the cache. */
+    if(to > pi->size) {
+        start = pi->size > from ? pi->size : from;
+        DEBUG("fadv_dontneed(fd=%d, from=%lld, len=%lld [file has grown])\n",
+              fd, (long long)start, (long long)(to - start));
+        fadv_dontneed(fd, start, to - start, nr_fadvise);
+    }
+}
+
+/* Called after len bytes were transferred at offset (or at the current file
+ * position, if offset is -1). Once the position has moved more than a
+ * window past what we dropped last time, drop the pages behind it. To keep
+ * the overhead low, this only looks at the file position every quarter
+ * window. */
+static void drop_behind(int fd, off_t offset, size_t len, bool write)
+{
+    off_t pos, until;
+    struct fd_slot *slot;
+    uint64_t start = stats_start();
+
+    if((slot = lock_slot(fd, false)) == NULL)
+        goto done;
+    if(slot->inode == NULL)
+        goto out;
+
+    slot->progress += len;
+    if(slot->progress < dropbehind / 4)
+        goto out;
+    slot->progress = 0;
+
+    if(offset == -1)
+        pos = lseek(fd, 0, SEEK_CUR);
+    else
+        pos = offset + len;
+    until = pos - dropbehind;
+    if(pos == -1 || until <= slot->behind)
+        goto out;
+
+    DEBUG("drop_behind(fd=%d, from=%lld, until=%lld)\n",
+          fd, (long long)slot->behind, (long long)until);
+    TRACE(TRACE_DROP_BEHIND, fd, slot->behind, until - slot->behind);
+    /* dirty pages can't be dropped, so write them back first */
+    if(write)
+        sync_range(fd, slot->behind, until - slot->behind);
+    pthread_mutex_lock(&slot->inode->lock);
+    fadv_dontneed_uncached(fd, &slot->inode->pi, slot->behind, until);
+    pthread_mutex_unlock(&slot->inode->lock);
+    slot->behind = until;
+
+    out:
+    unlock_slot(fd, slot);
+
+    done:
+    stats_stop(TIMER_DROP_BEHIND, start);
+}
+
+/* Called after len bytes were written at offset (or at the current file
+ * position, if offset is -1). Once a chunk's worth of data has been written
+ * past what was last submitted, start writeback of it without waiting. The
+ * chunk submitted before that has had a whole chunk's time to complete, so
+ * wait for it and drop it. Thus, at most about two chunks of dirty pages
+ * pile up for a sequential writer, and it rarely has to wait. */
+static void write_behind(int fd, off_t offset, size_t len)
+{
+    off_t pos;
+    struct fd_slot *slot;
+    uint64_t start = stats_start();
+
+    if((slot = lock_slot(fd, false)) == NULL)
+        goto done;
+    if(slot->inode == NULL)
+        goto out;
+
+    slot->wb_progress += len;
+    if(slot->wb_progress < writebehind)
+        goto out;
+    slot->wb_progress = 0;
+
+    if(offset == -1)
+        pos = lseek(fd, 0, SEEK_CUR);
+    else
+        pos = offset + len;
+    if(pos == -1 || pos - slot->wb_submitted < writebehind)
+        goto out;
+
+    DEBUG("write_behind(fd=%d, submit=%lld-%lld, drop=%lld-%lld)\n", fd,
+          (long long)slot->wb_submitted, (long long)pos,
+          (long long)slot->wb_done, (long long)slot->wb_submitted);
+    TRACE(TRACE_WRITE_BEHIND, fd, slot->wb_submitted, pos - slot->wb_submitted);
+    start_writeback(fd, slot->wb_submitted, pos - slot->wb_submitted);
+    if(slot->wb_submitted > slot->wb_done) {
+        sync_range(fd, slot->wb_done, slot->wb_submitted - slot->wb_done);
+        pthread_mutex_lock(&slot->inode->lock);
+        fadv_dontneed_uncached(fd, &slot->inode->pi, slot->wb_done,
+                slot->wb_submitted);
+        pthread_mutex_unlock(&slot->inode->lock);
+    }
+    slot->wb_done = slot->wb_submitted;
+    slot->wb_submitted = pos;
 
     out:
-    pthread_mutex_unlock(&fds_lock[fd]);
-    if(block_signals)
-        sigprocmask(SIG_SETMASK, &old_mask, NULL);
+    unlock_slot(fd, slot);
+
+    done:
+    stats_stop(TIMER_WRITE_BEHIND, start);
+}
+
+/* Whether others may move the file position of the slot's fd, too */
+static bool slot_pos_shared(struct fd_slot *slot)
+{
+    if(slot->fork_gen != __atomic_load_n(&fork_gen, __ATOMIC_RELAXED))
+        slot->pos_shared = true;
+    return slot->pos_shared;
+}
+
+/* Lazy and budget modes: the file position fd is at, or was at, before len
+ * bytes are transferred at it (or were, if done is set), -1 if it can't be
+ * told. The position is taken from the slot if the hooks have seen all that
+ * moves it, so that this doesn't cost a syscall. */
+static off_t transfer_pos(int fd, struct fd_slot *slot, size_t len, bool done)
+{
+    off_t pos = slot->pos;
+
+    if(pos == -1 || slot_pos_shared(slot)) {
+        if((pos = lseek(fd, 0, SEEK_CUR)) == -1)
+            return -1;
+        if(done)
+            pos -= len;
+    }
+    slot->pos = slot->pos_shared ? -1 : pos + (off_t)len;
+    return pos;
+}
+
+/* Tell the slot of fd where its file position is now (-1 if unknown), or
+ * that others may move it, too. */
+static void seen_pos(int fd, off_t pos, bool shared)
+{
+    struct fd_slot *slot;
+
+    if((!lazy && !budget) || (slot = lock_slot(fd, false)) == NULL)
+        return;
+    if(shared)
+        slot->pos_shared = true;
+    slot->pos = slot_pos_shared(slot) ? -1 : pos;
+    unlock_slot(fd, slot);
+}
+
+/* Lazy mode: called before len bytes are transferred at offset (or at the
+ * current file position, if offset is -1), so that the residency of that
+ * part of the file is recorded before the access changes it. */
+static void touch_pageinfo(int fd, off_t offset, size_t len)
+{
+    struct fd_slot *slot;
+    struct file_pageinfo *pi;
+    size_t cached;
+    uint64_t start = stats_start();
+
+    if((slot = lock_slot(fd, false)) == NULL)
+        goto done;
+    if(slot->inode == NULL || slot->inode->pi.segment_size == 0)
+        goto out;
+
+    if(offset == -1 && (offset = transfer_pos(fd, slot, len, false)) == -1)
+        goto out;
+    pi = &slot->inode->pi;
+    pthread_mutex_lock(&slot->inode->lock);
+    cached = pi->nr_pages_cached;
+    fd_touch_pageinfo(fd, pi, offset, len);
+    stats_add(STAT_PAGES_CACHED, pi->nr_pages_cached - cached);
+    pthread_mutex_unlock(&slot->inode->lock);
+
+    out:
+    unlock_slot(fd, slot);
+
+    done:
+    stats_stop(TIMER_TOUCH_PAGEINFO, start);
+}
+
+/* Bytes of [from, to) that were not cached when the file was opened. */
+static size_t uncached_bytes(const struct file_pageinfo *pi, off_t from,
+    off_t to)
+{
+    size_t lo = 0, hi = pi->nr_unmapped, mid, n = 0;
+    off_t start, end;
+    const struct byterange *br;
+
+    /* The ranges are sorted and don't overlap. */
+    while(lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if((off_t)(pi->unmapped[mid].pos + pi->unmapped[mid].len) <= from)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    for(br = pi->unmapped + lo; br < pi->unmapped + pi->nr_unmapped &&
+            (off_t)br->pos < to; br++) {
+        start = (off_t)br->pos > from ? (off_t)br->pos : from;
+        end = (off_t)(br->pos + br->len) < to ? (off_t)(br->pos + br->len) : to;
+        n += end - start;
+    }
+    if(to > pi->size)
+        n += to - (pi->size > from ? pi->size : from);
+    return n;
+}
+
+/* Return where the extent at index goes in the record's array, growing it
+ * if need be, or NULL if that fails. */
+static struct budget_extent **budget_slot(struct tracked_inode *inode,
+    size_t index)
+{
+    size_t n;
+    struct budget_extent **extents;
+
+    if(index >= inode->extents_size) {
+        for(n = inode->extents_size ? inode->extents_size : 16; n <= index;)
+            n *= 2;
+        if((extents = realloc(inode->extents, n * sizeof(*extents))) == NULL)
+            return NULL;
+        memset(extents + inode->extents_size, 0,
+            (n - inode->extents_size) * sizeof(*extents));
+        inode->extents = extents;
+        inode->extents_size = n;
+    }
+    return &inode->extents[index];
+}
+
+/* Take an extent off the ring and off the budget, onto the list of those
+ * to be dropped by budget_drop(). It stays in the record's array until
+ * then, so the record does not go away, and is left alone by everyone else.
+ * Called with budget_lock held. */
+static void budget_unlink(struct budget_extent *e, struct budget_extent **list)
+{
+    if(e->next == e) {
+        budget_hand = NULL;
+    } else {
+        if(budget_hand == e)
+            budget_hand = e->next;
+        e->prev->next = e->next;
+        e->next->prev = e->prev;
+    }
+    budget_used -= e->charged;
+    e->dropping = true;
+    e->next = *list;
+    *list = e;
+}
+
+/* Drop the pages of the extents on the list that were not cached at open,
+ * and forget the extents. If one was the last extent of a file that is
+ * closed, the record is freed. Writing back and dropping pages can take a
+ * while, so this is called without budget_lock held: it would hold up all
+ * reads and writes. */
+static void budget_drop(struct budget_extent *list)
+{
+    struct budget_extent *e;
+    struct tracked_inode *inode, **p;
+    struct inode_bucket *b;
+    off_t from;
+    bool gone;
+
+    for(e = list; e; e = e->next) {
+        if(!e->charged)
+            continue;
+        inode = e->inode;
+        from = e->index * BUDGET_EXTENT;
+        DEBUG("budget_drop(fd=%d, from=%lld, len=%d)\n", inode->budget_fd,
+              (long long)from, BUDGET_EXTENT);
+        TRACE(TRACE_BUDGET, inode->budget_fd, from, BUDGET_EXTENT);
+        /* dirty pages can't be dropped, so write them back first */
+        if(e->dirty)
+            sync_range(inode->budget_fd, from, BUDGET_EXTENT);
+        pthread_mutex_lock(&inode->lock);
+        fadv_dontneed_uncached(inode->budget_fd, &inode->pi, from,
+                from + BUDGET_EXTENT);
+        pthread_mutex_unlock(&inode->lock);
+    }
+    if(list == NULL)
+        return;
+
+    pthread_mutex_lock(&budget_lock);
+    while((e = list) != NULL) {
+        list = e->next;
+        inode = e->inode;
+        inode->extents[e->index] = NULL;
+        free(e);
+        if(--inode->nr_charged > 0)
+            continue;
+
+        /* A closed file is forgotten along with its last extent. */
+        b = inode_bucket(inode->dev, inode->ino);
+        pthread_mutex_lock(&b->lock);
+        if((gone = inode->refs == 0)) {
+            for(p = &b->head; *p != inode; p = &(*p)->next)
+                ;
+            *p = inode->next;
+        }
+        pthread_mutex_unlock(&b->lock);
+        if(gone)
+            free_inode(inode);
+    }
+    pthread_mutex_unlock(&budget_lock);
+}
+
+/* Pick extents to drop until the job is within its budget again, least
+ * recently used first, and return them for budget_drop(). This is the
+ * CLOCK approximation of LRU: new extents go in behind the hand, and one
+ * that was used again since the hand last passed it gets another round.
+ * Called with budget_lock held. */
+static struct budget_extent *budget_shrink(void)
+{
+    struct budget_extent *e, *list = NULL;
+
+    while(budget_used > budget && (e = budget_hand) != NULL) {
+        if(e->referenced) {
+            e->referenced = false;
+            budget_hand = e->next;
+        } else {
+            stats_add(STAT_BUDGET_DROPS, e->charged != 0);
+            budget_unlink(e, &list);
+        }
+    }
+    return list;
+}
+
+/* Budget mode: called after len bytes were transferred at offset (or at
+ * the current file position, if offset is -1). Charge the extents they are
+ * in, or mark them as used again if they are charged already; going on
+ * where the fd left off last time doesn't count as that, or every extent
+ * read in small pieces would look hot. */
+static void budget_touch(int fd, off_t offset, size_t len, bool write)
+{
+    struct fd_slot *slot;
+    struct tracked_inode *inode;
+    struct budget_extent **ep, *e, *drop;
+    size_t i;
+    uint64_t start = stats_start();
+
+    if((slot = lock_slot(fd, false)) == NULL)
+        goto done;
+    if((inode = slot->inode) == NULL || inode->pi.flushall)
+        goto out;
+    if(offset == -1 && (offset = transfer_pos(fd, slot, len, true)) == -1)
+        goto out;
+
+    pthread_mutex_lock(&budget_lock);
+    for(i = offset / BUDGET_EXTENT; i <= (offset + len - 1) / BUDGET_EXTENT;
+            i++) {
+        if((ep = budget_slot(inode, i)) == NULL)
+            break;
+        if((e = *ep) != NULL && e->dropping)
+            continue;
+        if(e != NULL) {
+            e->referenced = e->referenced || i + 1 != slot->budget_last;
+            e->dirty = e->dirty || write;
+            slot->budget_last = i + 1;
+            continue;
+        }
+
+        /* The fd may be closed long before the extent is dropped. */
+        if(inode->budget_fd == -1 &&
+                (inode->budget_fd = fcntl_dupfd_private(fd)) == -1)
+            break;
+        if((e = malloc(sizeof(*e))) == NULL)
+            break;
+        e->inode = inode;
+        e->index = i;
+        e->charged = uncached_bytes(&inode->pi, i * BUDGET_EXTENT,
+                (i + 1) * BUDGET_EXTENT);
+        e->referenced = false;
+        e->dirty = write;
+        e->dropping = false;
+        if(budget_hand == NULL) {
+            e->prev = e->next = budget_hand = e;
+        } else {
+            e->next = budget_hand;
+            e->prev = budget_hand->prev;
+            e->prev->next = e;
+            budget_hand->prev = e;
+        }
+        *ep = e;
+        slot->budget_last = i + 1;
+        inode->nr_charged++;
+        budget_used += e->charged;
+    }
+    drop = budget_shrink();
+    pthread_mutex_unlock(&budget_lock);
+    budget_drop(drop);
+
+    out:
+    unlock_slot(fd, slot);
+
+    done:
+    stats_stop(TIMER_BUDGET, start);
+}
+
+/* Add the part of [from, to) that was not cached at open to the ranges
+ * (n of them, room for *size), like fadv_dontneed_uncached() would drop
+ * it. Returns false if the array can't grow. */
+static bool add_uncached(struct file_pageinfo *pi, off_t from, off_t to,
+    struct byterange **ranges, size_t *n, size_t *size)
+{
+    struct byterange *br, *r;
+    off_t start, end;
+
+    for(br = pi->unmapped; from < to; br++) {
+        if(pi->flushall) {
+            start = from;
+            end = to;
+        } else if(br < pi->unmapped + pi->nr_unmapped) {
+            start = (off_t)br->pos > from ? (off_t)br->pos : from;
+            end = (off_t)(br->pos + br->len) < to ?
+                (off_t)(br->pos + br->len) : to;
+            if(start >= end)
+                continue;
+        } else if(to > pi->size) {
+            /* everything beyond the size at open time is new to the cache */
+            start = pi->size > from ? pi->size : from;
+            end = to;
+        } else
+            break;
+
+        if(*n == *size) {
+            if((r = realloc(*ranges, (*size * 2 + 8) * sizeof(*r))) == NULL)
+                return false;
+            *ranges = r;
+            *size = *size * 2 + 8;
+        }
+        (*ranges)[*n].pos = start;
+        (*ranges)[(*n)++].len = end - start;
+        if(end == to)
+            break;
+    }
+    return true;
+}
+
+/* The last fd for the file is being closed, but extents of it are charged,
+ * so those stay in the cache until the sweep gets to them. What else was
+ * not cached at open (e.g. was read through mmap) is dropped now, like at
+ * any close. Called with budget_lock held, so this only collects the
+ * ranges to drop into *ranges and returns how many there are; the caller
+ * drops them after letting go of the lock, as budget_drop() does. If there
+ * is no memory for all of them, the rest stays cached. */
+static size_t budget_close(int fd, struct tracked_inode *inode,
+    struct byterange **ranges)
+{
+    struct stat st;
+    off_t pos = 0, end = inode->pi.size;
+    size_t i, n = 0, size = 0;
+
+    *ranges = NULL;
+    if(fstat(fd, &st) != -1 && st.st_size > end)
+        end = st.st_size;
+    pthread_mutex_lock(&inode->lock);
+    for(i = 0; i < inode->extents_size; i++) {
+        if(inode->extents[i] == NULL)
+            continue;
+        if(pos < (off_t)(i * BUDGET_EXTENT) && !add_uncached(&inode->pi,
+                pos, i * BUDGET_EXTENT, ranges, &n, &size))
+            goto out;
+        pos = (i + 1) * BUDGET_EXTENT;
+    }
+    if(pos < end)
+        add_uncached(&inode->pi, pos, end, ranges, &n, &size);
+    out:
+    pthread_mutex_unlock(&inode->lock);
+    return n;
+}
+
+/* At exit, drop everything that is still charged. */
+static void budget_drain(void)
+{
+    struct budget_extent *drop = NULL;
+
+    pthread_mutex_lock(&budget_lock);
+    while(budget_hand != NULL)
+        budget_unlink(budget_hand, &drop);
+    pthread_mutex_unlock(&budget_lock);
+    budget_drop(drop);
+}
+
+/* In a forked child: what is charged is the parent's to drop, so forget
+ * it, along with the files only kept for the budget, and go on without a
+ * budget. Unless the parent's threads were stopped at fork, the extents
+ * themselves may be in any state; they are leaked then. */
+static void budget_child(bool consistent)
+{
+    int i;
+    size_t j;
+    struct tracked_inode *inode, **p;
+
+    for(i = 0; i < INODE_BUCKETS; i++) {
+        for(p = &inodes[i].head; (inode = *p) != NULL;) {
+            for(j = 0; consistent && j < inode->extents_size; j++)
+                free(inode->extents[j]);
+            if(consistent)
+                free(inode->extents);
+            inode->extents = NULL;
+            inode->extents_size = inode->nr_charged = 0;
+            if(inode->refs == 0) {
+                *p = inode->next;
+                free_inode(inode);
+                continue;
+            }
+            if(inode->budget_fd != -1)
+                _original_close(inode->budget_fd);
+            inode->budget_fd = -1;
+            p = &inode->next;
+        }
+    }
+    budget_hand = NULL;
+    budget_used = 0;
+    budget = 0;
+}
+
+static void *async_worker(void *arg)
+{
+    struct async_job job;
+
+    pthread_mutex_lock(&async_lock);
+    for(;;) {
+        while(async_len == 0 && !async_stop)
+            pthread_cond_wait(&async_cond, &async_lock);
+        if(async_len == 0)
+            break;
+        job = async_queue[async_head];
+        async_head = (async_head + 1) % async_size;
+        async_len--;
+        pthread_mutex_unlock(&async_lock);
+
+        DEBUG("async_worker: evicting fd=%d\n", job.fd);
+        TRACE(TRACE_ASYNC_EVICT, job.fd, 0, 0);
+        evict(job.fd, &job.pi);
+        free_pageinfo(&job.pi);
+        _original_close(job.fd);
+
+        pthread_mutex_lock(&async_lock);
+    }
+    pthread_mutex_unlock(&async_lock);
+    return NULL;
+}
+
+/* Hand a duplicate of fd and pi's ranges over to the worker, which is
+ * started if necessary. pi is left empty. Returns false if the caller has
+ * to do the work itself. Must be called with async_lock held. */
+static bool async_enqueue_locked(int fd, struct file_pageinfo *pi)
+{
+    int newfd;
+    sigset_t mask, oldmask;
+    struct async_job *job;
+
+    if(async_stop || async_len == async_size)
+        return false;
+
+    if(!async_running) {
+        /* signals are for the application's threads, not for ours */
+        sigfillset(&mask);
+        pthread_sigmask(SIG_SETMASK, &mask, &oldmask);
+        async_running = pthread_create(&async_thread, NULL,
+                async_worker, NULL) == 0;
+        pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
+        if(!async_running)
+            return false;
+    }
+
+    if((newfd = fcntl_dupfd_private(fd)) == -1)
+        return false;
+
+    job = &async_queue[(async_head + async_len) % async_size];
+    job->fd = newfd;
+    job->pi = *pi;
+    async_len++;
+    pthread_cond_signal(&async_cond);
+
+    pi->unmapped = NULL;
+    pi->nr_unmapped = 0;
+    pi->unmapped_size = 0;
+    pi->touched = NULL;
+    return true;
+}
+
+static bool async_enqueue(int fd, struct file_pageinfo *pi)
+{
+    bool ret;
+
+    pthread_mutex_lock(&async_lock);
+    ret = async_enqueue_locked(fd, pi);
+    pthread_mutex_unlock(&async_lock);
+    if(ret) {
+        DEBUG("async_enqueue(fd=%d)\n", fd);
+        TRACE(TRACE_ASYNC_ENQUEUE, fd, 0, 0);
+    }
+    return ret;
+}
+
+/* Let the worker finish all queued jobs and exit. */
+static void async_drain(void)
+{
+    bool running;
+
+    pthread_mutex_lock(&async_lock);
+    async_stop = true;
+    running = async_running;
+    pthread_cond_signal(&async_cond);
+    pthread_mutex_unlock(&async_lock);
+
+    if(running)
+        pthread_join(async_thread, NULL);
+    async_running = false;
+}
+
+/* Around fork(), hold async_lock so the child gets a consistent queue. The
+ * worker does not exist in the child; the queued jobs remain the parent's
+ * business (the page cache is shared), so the child just closes its copies
+ * of their fds. As in fds_prepare(), a fork() from a signal handler that
+ * interrupted a hook must not wait for the lock (this thread may hold it
+ * in async_enqueue()); the child re-initializes it anyway. */
+static bool async_locked;
+
+static void async_prepare(void)
+{
+    if((async_locked = !in_slot))
+        pthread_mutex_lock(&async_lock);
+}
+
+static void async_parent(void)
+{
+    if(async_locked)
+        pthread_mutex_unlock(&async_lock);
+}
+
+static void async_child(void)
+{
+    struct async_job *job;
+
+    pthread_mutex_init(&async_lock, NULL);
+    pthread_cond_init(&async_cond, NULL);
+    for(; async_len > 0; async_len--) {
+        job = &async_queue[async_head];
+        async_head = (async_head + 1) % async_size;
+        _original_close(job->fd);
+        free_pageinfo(&job->pi);
+    }
+    async_running = false;
 }
 
 /* vim:set et sw=4 ts=4: */
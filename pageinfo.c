@@ -2,13 +2,19 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <sys/sysmacros.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <errno.h>
 #include <string.h>
+#include <stdint.h>
 
 #include "pageinfo.h"
+#include "residency.h"
+#include "stats.h"
+#include "trace.h"
 
 extern FILE *debugfp;
 #define DEBUG(...) \
@@ -18,122 +24,388 @@ extern FILE *debugfp;
         } \
     } while(0)
 
-static int insert_into_br_list(struct file_pageinfo *pi,
-    struct byterange **brtail, size_t pos, size_t len);
+/* how much of a file is mapped and checked with mincore() at once */
+size_t pageinfo_scan_window = DEFAULT_SCAN_WINDOW;
+
+/* used if the device's readahead setting can't be found */
+#define DEFAULT_READAHEAD (2 * 1024 * 1024)
+
+static int init_pageinfo(int fd, struct file_pageinfo *pi);
+static int scan_pageinfo(int fd, struct file_pageinfo *pi, off_t offset,
+    off_t len);
+static int mincore_pageinfo(int fd, struct file_pageinfo *pi, off_t offset,
+    off_t len);
+static int append_range(struct file_pageinfo *pi, size_t pos, size_t len);
 
 struct file_pageinfo *fd_get_pageinfo(int fd, struct file_pageinfo *pi)
+{
+    if(!init_pageinfo(fd, pi))
+        return NULL;
+
+    /* If size is 0, mmap() will fail. We'll keep the fd stored, anyway, to
+     * make sure the newly written pages will be freed on close(). */
+    if(pi->size == 0)
+        return pi;
+
+    if(!scan_pageinfo(fd, pi, 0, pi->size)) {
+        free_pageinfo(pi);
+        return NULL;
+    }
+
+    return pi;
+}
+
+/* Like fd_get_pageinfo(), but don't look at the page cache yet: this is
+ * done segment by segment in fd_touch_pageinfo(), right before the
+ * application first accesses a segment. */
+struct file_pageinfo *fd_get_pageinfo_lazy(int fd, struct file_pageinfo *pi,
+    size_t segment_size)
+{
+    if(!init_pageinfo(fd, pi))
+        return NULL;
+    pi->segment_size = segment_size;
+    pi->lookahead = 0;
+    pi->nr_pages_cached = 0;
+    return pi;
+}
+
+/* Return the maximum readahead (in bytes) of the device the file open as fd
+ * lives on, as configured in /sys/class/bdi. The last answer is cached per
+ * thread, since one process usually works on files from few devices. Note
+ * that open() and read() are our own hooks; they don't track anything while
+ * the caller holds a slot lock, though. */
+static size_t readahead_size(int fd)
+{
+    static __thread dev_t cached_dev __attribute__((tls_model("initial-exec")));
+    static __thread size_t cached_size __attribute__((tls_model("initial-exec")));
+    struct stat st;
+    char path[64], buf[32];
+    int bdi;
+    ssize_t n;
+
+    if(fstat(fd, &st) == -1)
+        return DEFAULT_READAHEAD;
+    if(cached_size != 0 && cached_dev == st.st_dev)
+        return cached_size;
+
+    cached_dev = st.st_dev;
+    cached_size = DEFAULT_READAHEAD;
+    snprintf(path, sizeof(path), "/sys/class/bdi/%u:%u/read_ahead_kb",
+        major(st.st_dev), minor(st.st_dev));
+    if((bdi = open(path, O_RDONLY)) == -1)
+        return cached_size;
+    if((n = read(bdi, buf, sizeof(buf) - 1)) > 0) {
+        buf[n] = '\0';
+        if(atoll(buf) > 0)
+            cached_size = atoll(buf) * 1024;
+    }
+    close(bdi);
+    return cached_size;
+}
+
+/* Make sure the segments covering the byte range [offset, offset+len) have
+ * been scanned. The segments up to twice the readahead size after it are
+ * scanned, too, since the kernel may well bring in pages from there during
+ * the access (it keeps up to two readahead windows in flight). */
+void fd_touch_pageinfo(int fd, struct file_pageinfo *pi, off_t offset,
+    size_t len)
+{
+    size_t seg, first, last, nr_segments;
+
+    if(pi->segment_size == 0 || offset < 0 || offset >= pi->size)
+        return;
+
+    nr_segments = (pi->size + pi->segment_size - 1) / pi->segment_size;
+    if(pi->touched == NULL) {
+        pi->touched = calloc((nr_segments + 7) / 8, 1);
+        if(pi->touched == NULL)
+            return;
+    }
+
+    if(pi->lookahead == 0)
+        pi->lookahead = 2 * readahead_size(fd);
+
+    first = offset / pi->segment_size;
+    last = (offset + len + pi->lookahead) / pi->segment_size;
+    if(last >= nr_segments)
+        last = nr_segments - 1;
+
+    for(seg = first; seg <= last; seg++) {
+        if(pi->touched[seg / 8] & (1 << (seg % 8)))
+            continue;
+        pi->touched[seg / 8] |= 1 << (seg % 8);
+        DEBUG("fd_touch_pageinfo(fd=%d): scanning segment %zd\n", fd, seg);
+        scan_pageinfo(fd, pi, seg * pi->segment_size, pi->segment_size);
+    }
+}
+
+static int cmp_range(const void *a, const void *b)
+{
+    const struct byterange *x = a, *y = b;
+    return x->pos < y->pos ? -1 : x->pos > y->pos;
+}
+
+/* Number of intervals that would be left if intervals separated by at most
+ * gap bytes were merged. */
+static size_t count_ranges(struct file_pageinfo *pi, size_t gap)
+{
+    size_t i, n = 1;
+    for(i = 1; i < pi->nr_unmapped; i++)
+        if(pi->unmapped[i].pos - (pi->unmapped[i-1].pos
+                    + pi->unmapped[i-1].len) > gap)
+            n++;
+    return n;
+}
+
+/* Merge uncached intervals that are separated by at most gap bytes of cached
+ * pages, so they can be dropped with fewer fadvise calls. If max_ranges is
+ * non-zero and more intervals than that would be left, the gap is doubled
+ * until they fit. Returns the number of cached bytes that now lie inside an
+ * interval, i.e. that will be dropped although they were cached at open. */
+size_t coalesce_ranges(struct file_pageinfo *pi, size_t gap, size_t max_ranges)
+{
+    size_t i, n, sacrificed = 0;
+    struct byterange *br;
+
+    if(pi->nr_unmapped < 2)
+        return 0;
+
+    /* in lazy mode, segments are scanned in the order they are touched */
+    if(pi->segment_size)
+        qsort(pi->unmapped, pi->nr_unmapped, sizeof(*pi->unmapped),
+            cmp_range);
+
+    while(max_ranges && count_ranges(pi, gap) > max_ranges)
+        gap = gap ? 2 * gap : (size_t)getpagesize();
+    if(gap == 0)
+        return 0;
+
+    for(i = 1, n = 0; i < pi->nr_unmapped; i++) {
+        br = &pi->unmapped[n];
+        if(pi->unmapped[i].pos - (br->pos + br->len) <= gap) {
+            sacrificed += pi->unmapped[i].pos - (br->pos + br->len);
+            br->len = pi->unmapped[i].pos + pi->unmapped[i].len - br->pos;
+        } else {
+            pi->unmapped[++n] = pi->unmapped[i];
+        }
+    }
+    pi->nr_unmapped = n + 1;
+    return sacrificed;
+}
+
+void free_pageinfo(struct file_pageinfo *pi)
+{
+    free(pi->unmapped);
+    pi->unmapped = NULL;
+    pi->nr_unmapped = 0;
+    pi->unmapped_size = 0;
+    free(pi->touched);
+    pi->touched = NULL;
+}
+
+static int init_pageinfo(int fd, struct file_pageinfo *pi)
 {
     int PAGESIZE;
-    void *file;
-    struct byterange *br = NULL; /* tail of our interval list */
     struct stat st;
-    unsigned char *page_vec = NULL;
 
     PAGESIZE = getpagesize();
 
     if(pi->fd != fd) {
         DEBUG("fd_get_pageinfo BUG, pi->fd != fd\n");
-        return NULL;
+        return 0;
     }
-    pi->fd = fd;
     pi->unmapped = NULL;
+    pi->nr_unmapped = 0;
+    pi->unmapped_size = 0;
+    pi->segment_size = 0;
+    pi->touched = NULL;
 
     if(fstat(fd, &st) == -1 || !S_ISREG(st.st_mode))
-        return NULL;
+        return 0;
     pi->size = st.st_size;
     pi->nr_pages = (st.st_size + PAGESIZE - 1) / PAGESIZE;
+    pi->nr_pages_cached = pi->nr_pages;
     DEBUG("fd_get_pageinfo(fd=%d): st.st_size=%lld, nr_pages=%lld\n",
           fd, (long long)st.st_size, (long long)pi->nr_pages);
 
-    /* If size is 0, mmap() will fail. We'll keep the fd stored, anyway, to
-     * make sure the newly written pages will be freed on close(). */
-    if(pi->size == 0)
-        return pi;
+    return 1;
+}
 
-    /* If mmap() fails, we will probably have a file in write-only or
-     * append-only mode. In this mode the caller will not be able to
-     * bring in new pages anyway, but we'll record the current size */
-    file = mmap(NULL, st.st_size, PROT_NONE, MAP_SHARED, fd, 0);
-    if(file == MAP_FAILED) {
-        DEBUG("fd_get_pageinfo(fd=%d): mmap failed (don't worry), errno:%d, %s\n",
-                fd, errno, strerror(errno));
-        return pi;
-    }
+/* Like scan_pageinfo(), for ranges that are mixed or when cachestat() is
+ * missing: the range is mapped and checked pageinfo_scan_window bytes at a
+ * time, so the memory needed does not depend on the size of the file. */
+static int mincore_pageinfo(int fd, struct file_pageinfo *pi, off_t offset,
+    off_t len)
+{
+    int PAGESIZE;
+    void *file = NULL;
+    unsigned char *page_vec = NULL;
+    size_t i, start, nr_pages, window;
+    off_t pos, end;
+
+    PAGESIZE = getpagesize();
+
+    if(offset + len > pi->size)
+        len = pi->size - offset;
+    if(len <= 0)
+        return 1;
+    end = offset + len;
+
+    window = pageinfo_scan_window;
+    if(window == 0 || (off_t)window > len)
+        window = len;
+    nr_pages = (window + PAGESIZE - 1) / PAGESIZE;
 
-    page_vec = calloc(sizeof(*page_vec), pi->nr_pages);
+    page_vec = calloc(sizeof(*page_vec), nr_pages);
     if(!page_vec) {
-        DEBUG("calloc failed: size=%zd on fd=%d\n", pi->nr_pages, fd);
-        goto cleanup;
+        DEBUG("calloc failed: size=%zd on fd=%d\n", nr_pages, fd);
+        return 0;
     }
 
-    if(mincore(file, pi->size, page_vec) == -1)
-        goto cleanup;
+    for(pos = offset; pos < end; pos += window) {
+        if((off_t)window > end - pos)
+            window = end - pos;
+        nr_pages = (window + PAGESIZE - 1) / PAGESIZE;
 
-    munmap(file, st.st_size);
-    file = NULL;
+        /* If mmap() fails, we will probably have a file in write-only or
+         * append-only mode. In this mode the caller will not be able to
+         * bring in new pages anyway, but we'll record the current size */
+        file = mmap(NULL, window, PROT_NONE, MAP_SHARED, fd, pos);
+        if(file == MAP_FAILED) {
+            DEBUG("fd_get_pageinfo(fd=%d): mmap failed (don't worry), errno:%d, %s\n",
+                    fd, errno, strerror(errno));
+            break;
+        }
 
-    /* compute (byte) intervals that are *not* in the file system
-     * cache, since we will want to free those on close() */
-    pi->nr_pages_cached = pi->nr_pages;
-    size_t i, start = 0;
-    for(i = 0; i < pi->nr_pages; i++) {
-        if(!(page_vec[i] & 1))
-            continue;
-        if(start < i) {
-            insert_into_br_list(pi, &br, start * PAGESIZE,
-                (i - start) * PAGESIZE);
+        stats_add(STAT_MINCORE, 1);
+        TRACE(TRACE_SCAN, fd, pos, window);
+        if(mincore(file, window, page_vec) == -1)
+            goto cleanup;
+
+        munmap(file, window);
+        file = NULL;
+
+        /* in lazy mode, we count cached pages as we go */
+        if(pi->segment_size)
+            pi->nr_pages_cached += nr_pages;
+        for(i = 0; (start = find_resident(page_vec, i, nr_pages, 0)) < nr_pages; ) {
+            i = find_resident(page_vec, start, nr_pages, 1);
+            /* The last interval may end in a partial page at EOF. If the
+             * next window starts uncached, append_range() extends it. */
+            append_range(pi, pos + start * PAGESIZE, i < nr_pages ?
+                (i - start) * PAGESIZE : window - start * PAGESIZE);
             pi->nr_pages_cached -= i - start;
         }
-        start = i + 1;
-    }
-    /* Leftover interval: clear until end of file */
-    if(start < pi->nr_pages) {
-        insert_into_br_list(pi, &br, start * PAGESIZE,
-                pi->size - start * PAGESIZE);
-        pi->nr_pages_cached -= pi->nr_pages - start;
     }
 
     free(page_vec);
 
-    return pi;
+    return 1;
 
 cleanup:
-    if(file)
-        munmap(file, st.st_size);
+    munmap(file, window);
     free(page_vec);
-    return NULL;
+    return 0;
 }
 
-static int insert_into_br_list(struct file_pageinfo *pi,
-    struct byterange **brtail, size_t pos, size_t len)
+static long long cachestat_pages(int fd, off_t offset, off_t len)
 {
-    struct byterange *tmp;
-    tmp = malloc(sizeof(*tmp));
-    if(!tmp)
-        return 0;
+    stats_add(STAT_CACHESTAT, 1);
+    TRACE(TRACE_CACHESTAT, fd, offset, len);
+    return fd_cached_pages(fd, offset, len);
+}
 
-    tmp->pos = pos;
-    tmp->len = len;
-    tmp->next = NULL;
+/* [offset, offset+len) has cached of its pages in the cache, as counted by
+ * cachestat(). A range that is partly cached is split in halves, as long as
+ * it is larger than CACHESTAT_MIN_PAGES and only one of the halves is
+ * partly cached, i.e. until the boundary between a cached and an uncached
+ * part is found. If both halves are partly cached, the range is most likely
+ * fragmented, and mincore() is cheaper than going on. */
+#define CACHESTAT_MIN_PAGES 64
 
-    if(pi->unmapped == NULL) {
-        pi->unmapped = tmp;
-    } else if(*brtail != NULL) {
-        (*brtail)->next = tmp;
+static int split_pageinfo(int fd, struct file_pageinfo *pi, off_t offset,
+    off_t len, long long cached)
+{
+    int PAGESIZE = getpagesize();
+    long long nr_pages = (len + PAGESIZE - 1) / PAGESIZE;
+    long long left, right, nr_left = nr_pages / 2;
+    off_t half = nr_left * PAGESIZE;
+
+    if(cached == 0) {
+        /* in lazy mode, we count cached pages as we go */
+        if(!pi->segment_size)
+            pi->nr_pages_cached -= nr_pages;
+        return append_range(pi, offset, len);
     }
-    *brtail = tmp;
-    return 1;
+    if(cached >= nr_pages) {
+        if(pi->segment_size)
+            pi->nr_pages_cached += nr_pages;
+        return 1;
+    }
+    if(nr_pages <= CACHESTAT_MIN_PAGES)
+        return mincore_pageinfo(fd, pi, offset, len);
+
+    /* the page cache may change under our feet, so don't trust right if
+     * it doesn't add up */
+    left = cachestat_pages(fd, offset, half);
+    right = cached - left;
+    if(left < 0 || right < 0 || right > nr_pages - nr_left ||
+            (left > 0 && left < nr_left && right > 0 &&
+             right < nr_pages - nr_left))
+        return mincore_pageinfo(fd, pi, offset, len);
+
+    return split_pageinfo(fd, pi, offset, half, left) &&
+        split_pageinfo(fd, pi, offset + half, len - half, right);
+}
+
+/* Append the (byte) intervals of [offset, offset+len) that are *not* in the
+ * file system cache to pi->unmapped, since we will want to free those on
+ * close(). offset must be a multiple of the page size. Where the kernel has
+ * cachestat(), ranges that are entirely cached or uncached are found without
+ * mapping them; the rest is left to mincore(). */
+static int scan_pageinfo(int fd, struct file_pageinfo *pi, off_t offset,
+    off_t len)
+{
+    long long cached;
+
+    if(offset + len > pi->size)
+        len = pi->size - offset;
+    if(len <= 0)
+        return 1;
+    if(!residency_cachestat || (cached = cachestat_pages(fd, offset, len)) < 0)
+        return mincore_pageinfo(fd, pi, offset, len);
+    return split_pageinfo(fd, pi, offset, len, cached);
 }
 
-void free_br_list(struct byterange **br)
+/* Append [pos, pos+len) to the array of uncached intervals, which grows by
+ * doubling, so a file with n intervals costs O(log n) allocations. */
+static int append_range(struct file_pageinfo *pi, size_t pos, size_t len)
 {
-    struct byterange *tmp;
-    while(*br != NULL) {
-        tmp = *br;
-        (*br) = tmp->next;
-        free(tmp);
+    struct byterange *br;
+    size_t size;
+
+    /* merge with the previous interval if they touch */
+    if(pi->nr_unmapped > 0) {
+        br = &pi->unmapped[pi->nr_unmapped - 1];
+        if(br->pos + br->len == pos) {
+            br->len += len;
+            return 1;
+        }
+    }
+
+    if(pi->nr_unmapped == pi->unmapped_size) {
+        size = pi->unmapped_size ? 2 * pi->unmapped_size : 16;
+        br = realloc(pi->unmapped, size * sizeof(*br));
+        if(!br)
+            return 0;
+        pi->unmapped = br;
+        pi->unmapped_size = size;
     }
-    *br = NULL;
+
+    br = &pi->unmapped[pi->nr_unmapped++];
+    br->pos = pos;
+    br->len = len;
+    return 1;
 }
 
 /* vim:set et sw=4 ts=4: */
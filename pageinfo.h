@@ -1,6 +1,5 @@
 struct byterange {
     size_t pos, len;
-    struct byterange *next;
 };
 
 struct file_pageinfo {
@@ -8,8 +7,33 @@ struct file_pageinfo {
     off_t size;
     size_t nr_pages;
     size_t nr_pages_cached;
+    char flushall;  /* drop all pages on close, whether cached before or not */
+    /* uncached intervals, sorted unless scanned lazily: an array of
+     * nr_unmapped entries with room for unmapped_size */
     struct byterange *unmapped;
+    size_t nr_unmapped;
+    size_t unmapped_size;
+
+    /* lazy mode: the file is scanned in segments of segment_size bytes right
+     * before they are first touched; bit n of touched is set once segment n
+     * has been scanned. lookahead is how far beyond an access we need to
+     * scan to stay ahead of the kernel's readahead. */
+    size_t segment_size;
+    size_t lookahead;
+    unsigned char *touched;
 };
 
+/* files are scanned in windows of this many bytes (a multiple of the page
+ * size), so memory use while scanning is bounded by a page_vec of
+ * pageinfo_scan_window / PAGESIZE bytes */
+#define DEFAULT_SCAN_WINDOW (256 * 1024 * 1024)
+extern size_t pageinfo_scan_window;
+
 struct file_pageinfo *fd_get_pageinfo(int fd, struct file_pageinfo *pi);
-void free_br_list(struct byterange **br);
+struct file_pageinfo *fd_get_pageinfo_lazy(int fd, struct file_pageinfo *pi,
+    size_t segment_size);
+void fd_touch_pageinfo(int fd, struct file_pageinfo *pi, off_t offset,
+    size_t len);
+size_t coalesce_ranges(struct file_pageinfo *pi, size_t gap,
+    size_t max_ranges);
+void free_pageinfo(struct file_pageinfo *pi);
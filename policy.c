@@ -0,0 +1,329 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "policy.h"
+
+/* A policy file has one rule per line:
+ *
+ *     <action> <pattern> [min=<size>] [max=<size>] [flags=<flag>,...]
+ *
+ * where <action> is one of track, flushall or ignore, and <pattern> is either
+ * a path prefix or, if it contains any of "*?[", a glob matched against the
+ * whole path with fnmatch(3). A prefix matches whole path components only:
+ * /data/foo matches /data/foo and /data/foo/bar, but not /data/foobar. Flags are rdonly, wronly, rdwr, write (wronly
+ * or rdwr), creat, trunc and append; all listed flags must be set. The first
+ * rule that matches a file wins; if none does, the file is tracked. Empty
+ * lines and lines starting with '#' are ignored.
+ *
+ * Prefix patterns are compiled into a trie, so matching a path against them
+ * costs one walk down the trie, no matter how many rules there are. The walk
+ * collects the candidate rules in a bitmap, matching glob rules are added to
+ * it, and the candidates are then checked in order. */
+
+#define FLAG_RDONLY 1
+#define FLAG_WRONLY 2
+#define FLAG_RDWR   4
+#define FLAG_WRITE  8
+#define FLAG_CREAT  16
+#define FLAG_TRUNC  32
+#define FLAG_APPEND 64
+
+struct rule {
+    enum policy_action action;
+    char *glob;       /* NULL for prefix rules */
+    off_t min_size;
+    off_t max_size;   /* -1 if unlimited */
+    int flags;
+};
+
+/* Children of a node are a linked list of siblings, which keeps the trie
+ * small; nodes live in one array and refer to each other by index. */
+struct trie_node {
+    unsigned char c;
+    int child, sibling;   /* 0 for none (the root can't be a child) */
+    int rule;             /* rule with a prefix ending here, or -1 */
+};
+
+static struct rule *rules;
+static int nr_rules;
+static struct trie_node *trie;
+static int nr_nodes, trie_size;
+static int *globs;        /* indices of glob rules */
+static int nr_globs;
+static int needs;
+
+/* Parse a size like "512", "64K", "16M" or "1G" (in bytes). */
+off_t parse_size(const char *s)
+{
+    char *end;
+    long long n = strtoll(s, &end, 10);
+
+    switch(*end) {
+    case 'g': case 'G': n *= 1024;  /* fall through */
+    case 'm': case 'M': n *= 1024;  /* fall through */
+    case 'k': case 'K': n *= 1024;
+    }
+    return n < 0 ? 0 : n;
+}
+
+static int new_node(unsigned char c)
+{
+    struct trie_node *tmp;
+
+    if(nr_nodes == trie_size) {
+        trie_size = trie_size ? 2 * trie_size : 64;
+        tmp = realloc(trie, trie_size * sizeof(*trie));
+        if(tmp == NULL)
+            return -1;
+        trie = tmp;
+    }
+    trie[nr_nodes].c = c;
+    trie[nr_nodes].child = 0;
+    trie[nr_nodes].sibling = 0;
+    trie[nr_nodes].rule = -1;
+    return nr_nodes++;
+}
+
+static bool trie_insert(const char *prefix, int rule)
+{
+    int node = 0, next;
+
+    for(; *prefix; prefix++) {
+        for(next = trie[node].child; next; next = trie[next].sibling)
+            if(trie[next].c == (unsigned char)*prefix)
+                break;
+        if(!next) {
+            if((next = new_node(*prefix)) == -1)
+                return false;
+            trie[next].sibling = trie[node].child;
+            trie[node].child = next;
+        }
+        node = next;
+    }
+    /* if two rules have the same prefix, the first one always wins */
+    if(trie[node].rule == -1)
+        trie[node].rule = rule;
+    return true;
+}
+
+static bool parse_flags(char *s, int *flags)
+{
+    char *tok, *save;
+
+    for(tok = strtok_r(s, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        if(!strcmp(tok, "rdonly"))      *flags |= FLAG_RDONLY;
+        else if(!strcmp(tok, "wronly")) *flags |= FLAG_WRONLY;
+        else if(!strcmp(tok, "rdwr"))   *flags |= FLAG_RDWR;
+        else if(!strcmp(tok, "write"))  *flags |= FLAG_WRITE;
+        else if(!strcmp(tok, "creat"))  *flags |= FLAG_CREAT;
+        else if(!strcmp(tok, "trunc"))  *flags |= FLAG_TRUNC;
+        else if(!strcmp(tok, "append")) *flags |= FLAG_APPEND;
+        else return false;
+    }
+    return true;
+}
+
+/* Parse one line into r, which will become rules[nr_rules]. Returns false
+ * on syntax errors. */
+static bool parse_rule(char *line, struct rule *r)
+{
+    char *tok, *pattern, *save;
+
+    memset(r, 0, sizeof(*r));
+    r->max_size = -1;
+
+    tok = strtok_r(line, " \t\n", &save);
+    if(!strcmp(tok, "track"))
+        r->action = POLICY_TRACK;
+    else if(!strcmp(tok, "flushall"))
+        r->action = POLICY_FLUSHALL;
+    else if(!strcmp(tok, "ignore"))
+        r->action = POLICY_IGNORE;
+    else
+        return false;
+
+    if((pattern = strtok_r(NULL, " \t\n", &save)) == NULL)
+        return false;
+
+    while((tok = strtok_r(NULL, " \t\n", &save)) != NULL) {
+        if(!strncmp(tok, "min=", 4)) {
+            r->min_size = parse_size(tok + 4);
+        } else if(!strncmp(tok, "max=", 4)) {
+            r->max_size = parse_size(tok + 4);
+        } else if(!strncmp(tok, "flags=", 6)) {
+            if(!parse_flags(tok + 6, &r->flags))
+                return false;
+        } else {
+            return false;
+        }
+    }
+
+    if(strpbrk(pattern, "*?[") != NULL) {
+        if((r->glob = strdup(pattern)) == NULL)
+            return false;
+    } else if(!trie_insert(pattern, nr_rules)) {
+        return false;
+    }
+
+    if(r->min_size || r->max_size != -1)
+        needs |= POLICY_NEEDS_SIZE;
+    if(r->flags)
+        needs |= POLICY_NEEDS_FLAGS;
+    return true;
+}
+
+/* Read and compile the rules in file. Lines that can't be parsed are
+ * reported on stderr and skipped. Returns false if the file can't be
+ * read at all. */
+bool policy_load(const char *file)
+{
+    FILE *fp;
+    char line[4096], *s;
+    int lineno = 0;
+    struct rule *tmp;
+    int *tmp_globs;
+
+    if((fp = fopen(file, "r")) == NULL) {
+        fprintf(stderr, "[nocache] can't read policy file %s\n", file);
+        return false;
+    }
+    if(trie == NULL && new_node(0) == -1)
+        goto fail;
+
+    while(fgets(line, sizeof(line), fp) != NULL) {
+        lineno++;
+        for(s = line; *s == ' ' || *s == '\t'; s++)
+            ;
+        if(*s == '#' || *s == '\n' || *s == '\0')
+            continue;
+
+        tmp = realloc(rules, (nr_rules + 1) * sizeof(*rules));
+        if(tmp == NULL)
+            goto fail;
+        rules = tmp;
+        if(!parse_rule(s, &rules[nr_rules])) {
+            fprintf(stderr, "[nocache] %s:%d: invalid rule, ignored\n",
+                file, lineno);
+            continue;
+        }
+        if(rules[nr_rules].glob != NULL) {
+            tmp_globs = realloc(globs, (nr_globs + 1) * sizeof(*globs));
+            if(tmp_globs == NULL) {
+                free(rules[nr_rules].glob);
+                goto fail;
+            }
+            globs = tmp_globs;
+            globs[nr_globs++] = nr_rules;
+        }
+        nr_rules++;
+    }
+    fclose(fp);
+
+    if(nr_rules > 0)
+        needs |= POLICY_NEEDS_PATH;
+    return true;
+
+    fail:
+    fclose(fp);
+    policy_free();
+    return false;
+}
+
+int policy_needs(void)
+{
+    return needs;
+}
+
+static bool flags_match(int want, int flags)
+{
+    int acc = flags & O_ACCMODE;
+
+    if((want & FLAG_RDONLY) && acc != O_RDONLY)
+        return false;
+    if((want & FLAG_WRONLY) && acc != O_WRONLY)
+        return false;
+    if((want & FLAG_RDWR) && acc != O_RDWR)
+        return false;
+    if((want & FLAG_WRITE) && acc == O_RDONLY)
+        return false;
+    if((want & FLAG_CREAT) && !(flags & O_CREAT))
+        return false;
+    if((want & FLAG_TRUNC) && !(flags & O_TRUNC))
+        return false;
+    if((want & FLAG_APPEND) && !(flags & O_APPEND))
+        return false;
+    return true;
+}
+
+/* Find the first rule that matches the file and return its action. size
+ * and flags are only looked at if policy_needs() says so; path may be NULL
+ * if it is unknown, in which case only rules matching any path apply. */
+enum policy_action policy_match(const char *path, off_t size, int flags)
+{
+    int i, node, next;
+    uint64_t cand[(nr_rules + 63) / 64 + 1];
+    const char *p;
+    struct rule *r;
+
+    if(nr_rules == 0)
+        return POLICY_TRACK;
+
+    memset(cand, 0, sizeof(cand));
+    if(trie[0].rule != -1)
+        cand[trie[0].rule / 64] |= 1ULL << (trie[0].rule % 64);
+    if(path == NULL)
+        path = "";
+    for(node = 0, p = path; *p; p++) {
+        for(next = trie[node].child; next; next = trie[next].sibling)
+            if(trie[next].c == (unsigned char)*p)
+                break;
+        if(!next)
+            break;
+        node = next;
+        /* the prefix has to end at a component boundary of the path */
+        if(trie[node].rule != -1 && (*p == '/' || p[1] == '/' || !p[1]))
+            cand[trie[node].rule / 64] |= 1ULL << (trie[node].rule % 64);
+    }
+
+    for(i = 0; i < nr_globs; i++)
+        if(fnmatch(rules[globs[i]].glob, path, 0) == 0)
+            cand[globs[i] / 64] |= 1ULL << (globs[i] % 64);
+
+    for(i = 0; i < nr_rules; i++) {
+        if(!(cand[i / 64] & (1ULL << (i % 64))))
+            continue;
+        r = &rules[i];
+        if(r->min_size && size < r->min_size)
+            continue;
+        if(r->max_size != -1 && size > r->max_size)
+            continue;
+        if(r->flags && !flags_match(r->flags, flags))
+            continue;
+        return r->action;
+    }
+    return POLICY_TRACK;
+}
+
+void policy_free(void)
+{
+    int i;
+
+    for(i = 0; i < nr_rules; i++)
+        free(rules[i].glob);
+    free(rules);
+    free(trie);
+    free(globs);
+    rules = NULL;
+    trie = NULL;
+    globs = NULL;
+    nr_rules = nr_nodes = trie_size = nr_globs = 0;
+    needs = 0;
+}
+
+/* vim:set et sw=4 ts=4: */
@@ -0,0 +1,25 @@
+#ifndef _POLICY_H
+#define _POLICY_H
+
+#include <sys/types.h>
+#include <stdbool.h>
+
+/* What to do with a newly opened file */
+enum policy_action {
+    POLICY_TRACK,     /* drop pages that weren't cached at open on close */
+    POLICY_FLUSHALL,  /* drop all of the file's pages on close */
+    POLICY_IGNORE,    /* leave the file alone */
+};
+
+/* which facts about a file the loaded rules need to look at */
+#define POLICY_NEEDS_PATH  1
+#define POLICY_NEEDS_SIZE  2
+#define POLICY_NEEDS_FLAGS 4
+
+off_t parse_size(const char *s);
+bool policy_load(const char *file);
+int policy_needs(void);
+enum policy_action policy_match(const char *path, off_t size, int flags);
+void policy_free(void);
+
+#endif
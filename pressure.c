@@ -0,0 +1,214 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "pressure.h"
+#include "stats.h"
+
+/* The hooks are not to see our reads of /proc and /sys. */
+extern int (*_original_open)(const char *pathname, int flags, mode_t mode);
+extern ssize_t (*_original_read)(int fd, void *buf, size_t count);
+extern int (*_original_close)(int fd);
+
+int pressure_enabled;
+
+static char root[PATH_MAX];
+static char cgroup[PATH_MAX];   /* the process's cgroup, "" if unknown */
+static double psi_low = PRESSURE_PSI_LOW, psi_high = PRESSURE_PSI_HIGH;
+static double mem_low = PRESSURE_MEM_LOW, mem_high = PRESSURE_MEM_HIGH;
+static uint64_t interval;       /* in nanoseconds */
+
+/* what the last refresh found: the share to drop, in permille, or -1 if
+ * no signal could be read */
+static int share = -1;
+static uint64_t refreshed;      /* when, 0 if never */
+static int refreshing;          /* set while a thread refreshes */
+
+static uint64_t now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Read root/path into buf as a string. Returns false if that fails. */
+static bool read_file(const char *path, char *buf, size_t size)
+{
+    char file[PATH_MAX];
+    int fd;
+    ssize_t n;
+
+    if(snprintf(file, sizeof(file), "%s%s", root, path) >= (int)sizeof(file))
+        return false;
+    if((fd = _original_open(file, O_RDONLY | O_CLOEXEC, 0)) == -1)
+        return false;
+    n = _original_read(fd, buf, size - 1);
+    _original_close(fd);
+    if(n <= 0)
+        return false;
+    buf[n] = '\0';
+    return true;
+}
+
+/* Find "key <number>" at the start of a line of buf. */
+static bool find_value(const char *buf, const char *key, double *value)
+{
+    const char *p;
+    size_t len = strlen(key);
+
+    for(p = buf; p; p = strchr(p, '\n') ? strchr(p, '\n') + 1 : NULL)
+        if(strncmp(p, key, len) == 0) {
+            *value = strtod(p + len, NULL);
+            return true;
+        }
+    return false;
+}
+
+static bool read_psi(double *psi)
+{
+    char buf[256], *p;
+
+    if(!read_file("/proc/pressure/memory", buf, sizeof(buf)) ||
+            strncmp(buf, "some ", 5) != 0 || (p = strstr(buf, "avg10=")) == NULL)
+        return false;
+    *psi = strtod(p + 6, NULL);
+    return true;
+}
+
+/* Memory in use, in percent of the limit of the closest cgroup up the tree
+ * that has one, or of the host's memory. */
+static bool read_mem(double *mem)
+{
+    char path[PATH_MAX + 32], buf[8192], *slash;
+    double max, current, inactive, total, available;
+
+    snprintf(path, sizeof(path), "%s", cgroup);
+    while(cgroup[0] && strlen(path) > strlen("/sys/fs/cgroup")) {
+        slash = path + strlen(path);
+        strcpy(slash, "/memory.max");
+        if(read_file(path, buf, sizeof(buf)) && strncmp(buf, "max", 3) != 0 &&
+                (max = strtod(buf, NULL)) > 0) {
+            strcpy(slash, "/memory.current");
+            if(!read_file(path, buf, sizeof(buf)))
+                break;
+            current = strtod(buf, NULL);
+            strcpy(slash, "/memory.stat");
+            if(!read_file(path, buf, sizeof(buf)) ||
+                    !find_value(buf, "inactive_file ", &inactive))
+                inactive = 0;
+            *mem = current > inactive ? 100 * (current - inactive) / max : 0;
+            return true;
+        }
+        *slash = '\0';
+        if((slash = strrchr(path, '/')) == NULL)
+            break;
+        *slash = '\0';
+    }
+
+    if(!read_file("/proc/meminfo", buf, sizeof(buf)) ||
+            !find_value(buf, "MemTotal:", &total) ||
+            !find_value(buf, "MemAvailable:", &available) || total <= 0)
+        return false;
+    *mem = 100 - 100 * available / total;
+    return true;
+}
+
+/* How much a signal asks to drop, in permille */
+static int ask(double value, double low, double high)
+{
+    if(value <= low)
+        return 0;
+    if(value >= high)
+        return 1000;
+    return 1000 * (value - low) / (high - low);
+}
+
+static void refresh(void)
+{
+    double psi, mem;
+    int s = -1, a;
+
+    if(read_psi(&psi))
+        s = ask(psi, psi_low, psi_high);
+    if(read_mem(&mem) && (a = ask(mem, mem_low, mem_high)) > s)
+        s = a;
+    __atomic_store_n(&share, s, __ATOMIC_RELAXED);
+}
+
+bool pressure_init(const char *spec, const char *r, unsigned int ms)
+{
+    char buf[4096], *p, *end;
+    const char *s;
+    double low, high;
+
+    snprintf(root, sizeof(root), "%s", r ? r : "");
+    interval = ms * 1000000ULL;
+
+    /* e.g. "psi=1:10,mem=50:90"; anything else is ignored */
+    for(s = spec; s && *s; s = strchr(s, ',') ? strchr(s, ',') + 1 : NULL) {
+        if(strncmp(s, "psi=", 4) != 0 && strncmp(s, "mem=", 4) != 0)
+            continue;
+        low = strtod(s + 4, &end);
+        if(*end != ':' || (high = strtod(end + 1, NULL)) <= low)
+            continue;
+        if(s[0] == 'p') {
+            psi_low = low;
+            psi_high = high;
+        } else {
+            mem_low = low;
+            mem_high = high;
+        }
+    }
+
+    /* cgroup v2: "0::/path" */
+    if(read_file("/proc/self/cgroup", buf, sizeof(buf)) &&
+            (p = strstr(buf, "0::/")) != NULL && (p == buf || p[-1] == '\n')) {
+        p[strcspn(p, "\n")] = '\0';
+        snprintf(cgroup, sizeof(cgroup), "/sys/fs/cgroup%s",
+            strcmp(p + 3, "/") ? p + 3 : "");
+    }
+    pressure_enabled = 1;
+    return true;
+}
+
+unsigned int pressure_decide(void)
+{
+    uint64_t t = now(), last = __atomic_load_n(&refreshed, __ATOMIC_RELAXED);
+    int s, busy = 0;
+
+    /* One thread refreshes, the others go on with the last values. */
+    if((last == 0 || t - last >= interval) &&
+            __atomic_compare_exchange_n(&refreshing, &busy, 1, false,
+                __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        refresh();
+        __atomic_store_n(&refreshed, t ? t : 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&refreshing, 0, __ATOMIC_RELEASE);
+    }
+
+    if((s = __atomic_load_n(&share, __ATOMIC_RELAXED)) == -1)
+        s = 1000;
+    if(s == 0)
+        stats_add(STAT_PRESSURE_KEEP, 1);
+    else if(s < 1000)
+        stats_add(STAT_PRESSURE_PARTIAL, 1);
+    else
+        stats_add(STAT_PRESSURE_EVICT, 1);
+    return s;
+}
+
+/* In a forked child: a refresh some other thread of the parent was in the
+ * middle of won't finish here. */
+void pressure_fork(void)
+{
+    refreshing = 0;
+}
+
+/* vim:set et sw=4 ts=4: */
@@ -0,0 +1,40 @@
+#ifndef _PRESSURE_H
+#define _PRESSURE_H
+
+#include <stdbool.h>
+
+/* Adaptive eviction: how much of a file to drop on close depends on how
+ * short of memory the system is. Two signals are looked at, each with a
+ * low and a high threshold:
+ *
+ *   psi  the share of time tasks stalled on memory over the last 10 seconds
+ *        ("some avg10" in /proc/pressure/memory), in percent
+ *   mem  memory in use that can't be reclaimed cheaply, in percent: of the
+ *        cgroup's memory.max (memory.current minus the inactive_file of
+ *        memory.stat), found by walking up from the cgroup of the process
+ *        in /proc/self/cgroup, or of the whole host (MemAvailable of
+ *        /proc/meminfo) if no cgroup up the tree has a limit
+ *
+ * Below the low threshold, a signal asks for nothing to be dropped; above
+ * the high one, for everything; in between, for a share that grows
+ * linearly. The signal that asks for the most wins. If neither can be read,
+ * everything is dropped, as without adaptive eviction. The files are read
+ * at most once per interval; in between, the last values are used. */
+
+/* Defaults, which the spec can override, e.g. "psi=1:10,mem=50:90". */
+#define PRESSURE_PSI_LOW 1.0
+#define PRESSURE_PSI_HIGH 10.0
+#define PRESSURE_MEM_LOW 50.0
+#define PRESSURE_MEM_HIGH 90.0
+
+extern int pressure_enabled;
+
+/* root is prepended to all paths (e.g. a fake /proc and /sys/fs/cgroup for
+ * testing), interval is in milliseconds. */
+bool pressure_init(const char *spec, const char *root, unsigned int interval);
+/* Returns the share of what was not cached at open to drop now, in
+ * permille, and counts the decision in the stats. */
+unsigned int pressure_decide(void);
+void pressure_fork(void);
+
+#endif
@@ -0,0 +1,525 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sched.h>
+#include <signal.h>
+#include <time.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "inode_hash.h"
+#include "pageinfo.h"
+#include "registry.h"
+#include "stats.h"
+
+int registry_enabled;
+
+static struct registry_header *header;
+static struct registry_bucket *buckets;
+static struct registry_entry *entries;
+static uint32_t nr_entries;
+static pid_t pid;
+static uint64_t image;  /* tells us apart from earlier images of pid */
+static pid_t parent_pid;  /* in a forked child, the parent's */
+static uint64_t parent_image;
+
+static uint64_t new_image(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static bool alive(pid_t p)
+{
+    int saved = errno;
+    bool ret = kill(p, 0) == 0 || errno != ESRCH;
+
+    errno = saved;
+    return ret;
+}
+
+static void lock(uint32_t *l)
+{
+    uint32_t owner;
+    unsigned int spins;
+
+    for(spins = 1; ; spins++) {
+        owner = 0;
+        if(__atomic_compare_exchange_n(l, &owner, pid, false,
+                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            return;
+        /* The owner may have died with the lock held. */
+        if(spins % 1024 == 0 && !alive(owner) &&
+                __atomic_compare_exchange_n(l, &owner, pid, false,
+                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            return;
+        sched_yield();
+    }
+}
+
+static void unlock(uint32_t *l)
+{
+    __atomic_store_n(l, 0, __ATOMIC_RELEASE);
+}
+
+/* Map the registry file. It is closed right away, so it doesn't take up an
+ * fd of the program. */
+bool registry_init(const char *file)
+{
+    int fd;
+    struct stat st;
+    void *map;
+    uint64_t magic = 0;
+    size_t fixed = sizeof(*header) + REGISTRY_BUCKETS * sizeof(*buckets);
+
+    if((fd = open(file, O_RDWR | O_CLOEXEC)) == -1)
+        return false;
+    if(fstat(fd, &st) == -1 || st.st_size < (off_t)(fixed + sizeof(*entries))) {
+        close(fd);
+        return false;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED)
+        return false;
+
+    header = map;
+    if(!__atomic_compare_exchange_n(&header->magic, &magic, REGISTRY_MAGIC,
+                false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) &&
+            magic != REGISTRY_MAGIC) {
+        munmap(map, st.st_size);
+        return false;
+    }
+    buckets = (struct registry_bucket *)(header + 1);
+    entries = (struct registry_entry *)(buckets + REGISTRY_BUCKETS);
+    nr_entries = (st.st_size - fixed) / sizeof(*entries);
+    pid = getpid();
+    image = new_image();
+    registry_enabled = 1;
+    return true;
+}
+
+_Static_assert(sizeof(struct registry_block) <= sizeof(struct registry_entry),
+    "a block takes the place of an entry");
+
+static struct registry_bucket *bucket_of(dev_t dev, ino_t ino)
+{
+    return &buckets[(inode_hash(dev, ino) >> 32) % REGISTRY_BUCKETS];
+}
+
+static uint32_t alloc_entry(void)
+{
+    uint32_t ref = 0;
+
+    lock(&header->alloc_lock);
+    if(header->free_head) {
+        ref = header->free_head;
+        header->free_head = entries[ref - 1].next;
+    } else if(header->nr_used < nr_entries) {
+        ref = ++header->nr_used;
+    }
+    unlock(&header->alloc_lock);
+    return ref;
+}
+
+static void free_entry(uint32_t ref)
+{
+    lock(&header->alloc_lock);
+    entries[ref - 1].next = header->free_head;
+    header->free_head = ref;
+    unlock(&header->alloc_lock);
+}
+
+static struct registry_block *block(uint32_t ref)
+{
+    return (struct registry_block *)&entries[ref - 1];
+}
+
+static void free_blocks(uint32_t ref)
+{
+    uint32_t next;
+
+    for(; ref; ref = next) {
+        next = block(ref)->next;
+        free_entry(ref);
+    }
+}
+
+/* The holder slots of an entry, in the entry and then in its blocks */
+struct holders {
+    struct registry_entry *e;
+    struct registry_block *b;  /* NULL while in the entry */
+    int i;
+};
+
+static struct registry_holder *next_holder(struct holders *it)
+{
+    uint32_t ref;
+
+    if(it->b == NULL) {
+        if(it->i < REGISTRY_HOLDERS)
+            return &it->e->holders[it->i++];
+        ref = it->e->more_holders;
+    } else {
+        if(it->i < REGISTRY_BLOCK_HOLDERS)
+            return &it->b->holders[it->i++];
+        ref = it->b->next;
+    }
+    if(ref == 0)
+        return NULL;
+    it->b = block(ref);
+    it->i = 0;
+    return &it->b->holders[it->i++];
+}
+
+/* Add a reference of ours. If our pid is listed with another image, that
+ * image has exec'd into us and won't let go of its references any more;
+ * they become ours. If there is no free slot, the slots of holders that
+ * have died are reused, or another block is chained to the entry; false if
+ * the registry is full. */
+static bool add_holder(struct registry_entry *e)
+{
+    struct holders it = { e, NULL, 0 };
+    struct registry_holder *h, *slot = NULL;
+    struct registry_block *b;
+    uint32_t ref;
+
+    while((h = next_holder(&it)) != NULL) {
+        if(h->pid == pid) {
+            if(h->image != image) {
+                h->image = image;
+                h->refs = 0;
+            }
+            h->refs++;
+            return true;
+        }
+        if(h->pid == 0 && slot == NULL)
+            slot = h;
+    }
+    for(it.b = NULL, it.i = 0; slot == NULL && (h = next_holder(&it)); )
+        if(!alive(h->pid))
+            slot = h;
+    if(slot == NULL) {
+        if((ref = alloc_entry()) == 0)
+            return false;
+        b = block(ref);
+        memset(b, 0, sizeof(*b));
+        b->next = e->more_holders;
+        e->more_holders = ref;
+        slot = &b->holders[0];
+    }
+    slot->pid = pid;
+    slot->image = image;
+    slot->refs = 1;
+    return true;
+}
+
+/* Whether a holder is left that is alive; dead ones found on the way are
+ * dropped. */
+static bool held(struct registry_entry *e)
+{
+    struct holders it = { e, NULL, 0 };
+    struct registry_holder *h;
+
+    while((h = next_holder(&it)) != NULL) {
+        if(h->pid == 0)
+            continue;
+        if(h->pid == pid || alive(h->pid))
+            return true;
+        h->pid = 0;
+    }
+    return false;
+}
+
+/* Copy the ranges of a published entry, which don't change any more */
+static void copy_ranges(struct registry_entry *e, struct byterange *ranges)
+{
+    uint32_t i, j, ref;
+
+    for(i = 0; i < e->nr_ranges && i < REGISTRY_RANGES; i++) {
+        ranges[i].pos = e->ranges[i].pos;
+        ranges[i].len = e->ranges[i].len;
+    }
+    for(ref = e->more_ranges; ref; ref = block(ref)->next)
+        for(j = 0; j < REGISTRY_BLOCK_RANGES && i < e->nr_ranges; i++, j++) {
+            ranges[i].pos = block(ref)->ranges[j].pos;
+            ranges[i].len = block(ref)->ranges[j].len;
+        }
+}
+
+/* Register this process as a holder of the file. If it is new to the
+ * registry, or whoever was scanning it has died, the caller is to scan it;
+ * if someone else is scanning it, wait for them. */
+enum registry_result registry_acquire(dev_t dev, ino_t ino, bool flush,
+    struct file_pageinfo *pi, uint32_t *ref)
+{
+    struct registry_bucket *b = bucket_of(dev, ino);
+    struct registry_entry *e;
+    uint32_t r;
+
+    lock(&b->lock);
+    for(r = b->head; r; r = entries[r - 1].next)
+        if(entries[r - 1].dev == dev && entries[r - 1].ino == ino)
+            break;
+
+    if(r == 0) {
+        if((r = alloc_entry()) == 0) {
+            unlock(&b->lock);
+            return REGISTRY_FULL;
+        }
+        e = &entries[r - 1];
+        memset(e, 0, offsetof(struct registry_entry, ranges));
+        e->dev = dev;
+        e->ino = ino;
+        e->state = REGISTRY_SCANNING;
+        e->scanner = pid;
+        e->flushall = flush;
+        add_holder(e);
+        e->next = b->head;
+        b->head = r;
+        unlock(&b->lock);
+        *ref = r;
+        return REGISTRY_SCAN;
+    }
+
+    /* Once we are a holder, the entry stays. */
+    e = &entries[r - 1];
+    if(!add_holder(e)) {
+        unlock(&b->lock);
+        return REGISTRY_FULL;
+    }
+    if(flush)
+        e->flushall = 1;
+    *ref = r;
+    while(e->state != REGISTRY_READY) {
+        if(e->scanner == 0 || !alive(e->scanner)) {
+            e->scanner = pid;
+            unlock(&b->lock);
+            return REGISTRY_SCAN;
+        }
+        unlock(&b->lock);
+        sched_yield();
+        lock(&b->lock);
+    }
+    pi->size = e->size;
+    pi->nr_pages = e->nr_pages;
+    pi->nr_pages_cached = e->nr_pages_cached;
+    pi->flushall = pi->flushall || e->flushall;
+    pi->nr_unmapped = e->nr_ranges;
+    unlock(&b->lock);
+
+    pi->unmapped_size = pi->nr_unmapped;
+    if(pi->nr_unmapped &&
+            (pi->unmapped = malloc(pi->nr_unmapped * sizeof(*pi->unmapped)))
+            == NULL) {
+        pi->nr_unmapped = pi->unmapped_size = 0;
+        registry_release(r);
+        return REGISTRY_FULL;
+    }
+    copy_ranges(e, pi->unmapped);
+    return REGISTRY_COPIED;
+}
+
+/* Store what the scan found, for the other processes. The ranges that
+ * don't fit into the entry go into blocks; if there is no room for them,
+ * none are stored, so the other processes take the whole file as cached
+ * and leave it be. */
+void registry_publish(uint32_t ref, struct file_pageinfo *pi)
+{
+    struct registry_entry *e = &entries[ref - 1];
+    struct registry_bucket *b = bucket_of(e->dev, e->ino);
+    uint32_t head = 0, *tail = &head, r;
+    size_t i, j, n = pi->nr_unmapped;
+
+    for(i = REGISTRY_RANGES; i < n; ) {
+        if((r = alloc_entry()) == 0) {
+            free_blocks(head);
+            head = 0;
+            n = 0;
+            break;
+        }
+        block(r)->next = 0;
+        for(j = 0; j < REGISTRY_BLOCK_RANGES && i < n; i++, j++) {
+            block(r)->ranges[j].pos = pi->unmapped[i].pos;
+            block(r)->ranges[j].len = pi->unmapped[i].len;
+        }
+        *tail = r;
+        tail = &block(r)->next;
+    }
+
+    lock(&b->lock);
+    e->size = pi->size;
+    e->nr_pages = pi->nr_pages;
+    e->nr_pages_cached = pi->nr_pages_cached;
+    e->nr_ranges = n;
+    e->more_ranges = head;
+    for(i = 0; i < n && i < REGISTRY_RANGES; i++) {
+        e->ranges[i].pos = pi->unmapped[i].pos;
+        e->ranges[i].len = pi->unmapped[i].len;
+    }
+    e->state = REGISTRY_READY;
+    e->scanner = 0;
+    pi->flushall = pi->flushall || e->flushall;
+    unlock(&b->lock);
+}
+
+/* Drop a reference of the holder p, i */
+static void drop_ref(struct registry_entry *e, pid_t p, uint64_t i)
+{
+    struct holders it = { e, NULL, 0 };
+    struct registry_holder *h;
+
+    while((h = next_holder(&it)) != NULL)
+        if(h->pid == p && h->image == i) {
+            if(--h->refs == 0)
+                h->pid = 0;
+            return;
+        }
+}
+
+/* Unlink a released entry from its bucket, with the bucket locked */
+static void unlink_entry(struct registry_bucket *b, uint32_t ref)
+{
+    uint32_t *p;
+
+    for(p = &b->head; *p != ref; p = &entries[*p - 1].next)
+        ;
+    *p = entries[ref - 1].next;
+}
+
+static void free_unlinked(uint32_t ref)
+{
+    free_blocks(entries[ref - 1].more_holders);
+    free_blocks(entries[ref - 1].more_ranges);
+    free_entry(ref);
+}
+
+/* Drop one of this process's references. Holders that have exited without
+ * letting go (through _exit or a crash) are dropped, too. Returns true if
+ * no holder is left: the caller is to evict the file. */
+bool registry_release(uint32_t ref)
+{
+    struct registry_entry *e = &entries[ref - 1];
+    struct registry_bucket *b = bucket_of(e->dev, e->ino);
+    bool last;
+
+    lock(&b->lock);
+    drop_ref(e, pid, image);
+    if(e->state == REGISTRY_SCANNING && e->scanner == pid)
+        e->scanner = 0;
+    if((last = !held(e)))
+        unlink_entry(b, ref);
+    unlock(&b->lock);
+
+    if(last)
+        free_unlinked(ref);
+    return last;
+}
+
+/* Before fork(): take another reference to an entry we hold, for the
+ * child to take over with registry_hold(). Until it has, the parent can't
+ * be the last to let go of the file. If fork() fails, the reference stays
+ * with the parent until it exits. */
+void registry_prefork(uint32_t ref)
+{
+    struct registry_entry *e = &entries[ref - 1];
+    struct registry_bucket *b = bucket_of(e->dev, e->ino);
+
+    lock(&b->lock);
+    add_holder(e);
+    unlock(&b->lock);
+}
+
+/* In a forked child: from now on, we are a process of our own. */
+void registry_fork(void)
+{
+    parent_pid = pid;
+    parent_image = image;
+    pid = getpid();
+    image = new_image();
+}
+
+/* In a forked child: take over the reference the parent took for us in
+ * registry_prefork(). False if there is no room for a holder of our own;
+ * the reference is dropped then, and the child is to track the file on its
+ * own. */
+bool registry_hold(uint32_t ref)
+{
+    struct registry_entry *e = &entries[ref - 1];
+    struct registry_bucket *b = bucket_of(e->dev, e->ino);
+    bool ret;
+
+    lock(&b->lock);
+    ret = add_holder(e);
+    drop_ref(e, parent_pid, parent_image);
+    unlock(&b->lock);
+    return ret;
+}
+
+/* Whether an earlier image of our pid held the file: an fd we inherited
+ * across exec is open on it. */
+bool registry_held(dev_t dev, ino_t ino)
+{
+    struct registry_bucket *b = bucket_of(dev, ino);
+    struct registry_entry *e;
+    struct holders it;
+    struct registry_holder *h;
+    uint32_t r;
+    bool ret = false;
+
+    lock(&b->lock);
+    for(r = b->head; r && !ret; r = e->next) {
+        e = &entries[r - 1];
+        if(e->dev != dev || e->ino != ino)
+            continue;
+        for(it.e = e, it.b = NULL, it.i = 0; (h = next_holder(&it)); )
+            if(h->pid == pid && h->image != image)
+                ret = true;
+    }
+    unlock(&b->lock);
+    return ret;
+}
+
+/* At start-up, after taking over the files we still have open: drop the
+ * references earlier images of our pid (one that exec'd into us, or a dead
+ * process whose pid we got) left behind. Files nobody else holds any more
+ * are left in the cache; their fds are gone, so they can't be evicted. */
+void registry_exec(void)
+{
+    struct registry_bucket *b;
+    struct registry_entry *e;
+    struct holders it;
+    struct registry_holder *h;
+    uint32_t r, next;
+    bool dropped;
+
+    for(b = buckets; b < buckets + REGISTRY_BUCKETS; b++) {
+        if(__atomic_load_n(&b->head, __ATOMIC_RELAXED) == 0)
+            continue;
+        lock(&b->lock);
+        for(r = b->head; r; r = next) {
+            e = &entries[r - 1];
+            next = e->next;
+            dropped = false;
+            for(it.e = e, it.b = NULL, it.i = 0; (h = next_holder(&it)); )
+                if(h->pid == pid && h->image != image) {
+                    h->pid = 0;
+                    dropped = true;
+                }
+            if(dropped && !held(e)) {
+                unlink_entry(b, r);
+                free_unlinked(r);
+            }
+        }
+        unlock(&b->lock);
+    }
+}
+
+/* vim:set et sw=4 ts=4: */
@@ -0,0 +1,114 @@
+#ifndef _REGISTRY_H
+#define _REGISTRY_H
+
+#include <sys/types.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+struct file_pageinfo;
+
+/* A registry shared by a whole process tree, through a file that the
+ * nocache wrapper creates (on tmpfs) and names in NOCACHE_SHARED. It maps
+ * (st_dev, st_ino) to what was cached when the first process in the tree
+ * opened the file and to the processes that have it open, so the file is
+ * scanned once and its pages are only dropped when the last of them
+ * closes it. A zero-filled file is an empty registry.
+ *
+ * The file is a struct registry_header, REGISTRY_BUCKETS struct
+ * registry_bucket and as many struct registry_entry as fit. Entries are
+ * chained per bucket and taken from a free list, or from the part of the
+ * file not used so far. Each bucket is protected by a spinlock that holds
+ * the pid of its owner, so a lock held by a process that died can be
+ * taken over. Holders and ranges that don't fit into an entry go into
+ * blocks chained to it, which are taken from the entries, too.
+ *
+ * A holder is a process image: its pid, a number that tells it apart from
+ * the images that pid ran before an exec, and how many references it
+ * holds. A new image drops what an earlier image of its pid held (see
+ * registry_exec()), except for the files it still has open, which it takes
+ * over; the same happens when it acquires a file that is listed under its
+ * pid. So every reference belongs to a live image or to a dead pid, and
+ * dead pids are dropped by the next process to release the file. */
+
+#define REGISTRY_MAGIC 0x33676572636f6eULL  /* "nocreg3" */
+#define REGISTRY_BUCKETS 1024
+#define REGISTRY_HOLDERS 16
+#define REGISTRY_RANGES 64
+#define REGISTRY_BLOCK_HOLDERS 64
+#define REGISTRY_BLOCK_RANGES 64
+
+enum registry_state {
+    REGISTRY_SCANNING = 1,  /* scanner is scanning the file */
+    REGISTRY_READY,         /* the ranges are valid */
+};
+
+struct registry_header {
+    uint64_t magic;
+    uint32_t alloc_lock;    /* protects free_head and nr_used */
+    uint32_t free_head;     /* index + 1 of the first free entry, or 0 */
+    uint32_t nr_used;       /* entries ever handed out */
+    uint32_t reserved;
+};
+
+struct registry_bucket {
+    uint32_t lock;          /* pid of the owner, 0 if free */
+    uint32_t head;          /* index + 1 of the first entry, or 0 */
+};
+
+struct registry_holder {
+    int32_t pid;            /* 0 if the slot is free */
+    uint32_t refs;
+    uint64_t image;
+};
+
+struct registry_range {
+    uint64_t pos, len;
+};
+
+struct registry_entry {
+    uint32_t next;          /* index + 1, in the bucket or the free list */
+    uint32_t state;
+    int32_t scanner;
+    uint32_t more_holders;  /* index + 1 of the first block, or 0 */
+    uint64_t dev, ino;
+    struct registry_holder holders[REGISTRY_HOLDERS];
+    uint32_t flushall;
+    uint32_t nr_ranges;     /* in all, including those in blocks */
+    uint32_t more_ranges;   /* index + 1 of the first block, or 0 */
+    uint32_t reserved;
+    int64_t size;
+    uint64_t nr_pages, nr_pages_cached;
+    struct registry_range ranges[REGISTRY_RANGES];
+};
+
+/* More holders or ranges of an entry, in the place of an entry */
+struct registry_block {
+    uint32_t next;          /* index + 1 of the next block, or 0 */
+    uint32_t reserved;
+    union {
+        struct registry_holder holders[REGISTRY_BLOCK_HOLDERS];
+        struct registry_range ranges[REGISTRY_BLOCK_RANGES];
+    };
+};
+
+/* what registry_acquire() found */
+enum registry_result {
+    REGISTRY_FULL = -1,     /* no room; track the file on your own */
+    REGISTRY_COPIED,        /* pi was filled in from the registry */
+    REGISTRY_SCAN,          /* scan the file, then call registry_publish() */
+};
+
+extern int registry_enabled;
+
+bool registry_init(const char *file);
+enum registry_result registry_acquire(dev_t dev, ino_t ino, bool flush,
+    struct file_pageinfo *pi, uint32_t *ref);
+void registry_publish(uint32_t ref, struct file_pageinfo *pi);
+bool registry_release(uint32_t ref);
+void registry_prefork(uint32_t ref);
+void registry_fork(void);
+bool registry_hold(uint32_t ref);
+bool registry_held(dev_t dev, ino_t ino);
+void registry_exec(void);
+
+#endif
@@ -0,0 +1,225 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "residency.h"
+
+/* cachestat(2) appeared in Linux 6.5, with the same number everywhere */
+#ifndef __NR_cachestat
+#define __NR_cachestat 451
+#endif
+
+struct cachestat_range {
+    uint64_t off, len;
+};
+
+struct cachestat {
+    uint64_t nr_cache, nr_dirty, nr_writeback;
+    uint64_t nr_evicted, nr_recently_evicted;
+};
+
+int residency_cachestat = 1;
+
+/* The number of cached pages of [offset, offset+len) (up to the end of the
+ * file if len is 0), from cachestat(2), which neither maps the file nor
+ * needs a vector. Returns -1 if the kernel doesn't have it, or on errors. */
+long long fd_cached_pages(int fd, off_t offset, off_t len)
+{
+    struct cachestat_range r = { offset, len };
+    struct cachestat cs;
+
+    if(!__atomic_load_n(&residency_cachestat, __ATOMIC_RELAXED))
+        return -1;
+    if(syscall(__NR_cachestat, fd, &r, &cs, 0) == -1) {
+        /* EPERM: a seccomp filter that doesn't know about it */
+        if(errno == ENOSYS || errno == EPERM)
+            __atomic_store_n(&residency_cachestat, 0, __ATOMIC_RELAXED);
+        return -1;
+    }
+    return cs.nr_cache;
+}
+
+/* Number of resident pages in vec[0..n), eight entries at a time: only the
+ * lowest bit of each entry is defined, so mask them and count the bits. */
+size_t count_resident(const unsigned char *vec, size_t n)
+{
+    const uint64_t ones = 0x0101010101010101ULL;
+    uint64_t w;
+    size_t i, count = 0;
+
+    for(i = 0; i + sizeof(w) <= n; i += sizeof(w)) {
+        memcpy(&w, vec + i, sizeof(w));
+        count += __builtin_popcountll(w & ones);
+    }
+    for(; i < n; i++)
+        count += vec[i] & 1;
+    return count;
+}
+
+/* Index of the first entry from i on in vec[0..n) that is resident (or not),
+ * or n if there is none; looks at eight entries at a time while it can. */
+size_t find_resident(const unsigned char *vec, size_t i, size_t n, int resident)
+{
+    const uint64_t ones = 0x0101010101010101ULL;
+    uint64_t w, skip = resident ? 0 : ones;
+
+    for(; i + sizeof(w) <= n; i += sizeof(w)) {
+        memcpy(&w, vec + i, sizeof(w));
+        if((w & ones) != skip)
+            break;
+    }
+    while(i < n && (vec[i] & 1) != resident)
+        i++;
+    return i;
+}
+
+/* Call fn for each window of [offset, offset+len) of fd, clipped to the
+ * size of the file; a len of 0 means up to the end of the file. offset is
+ * rounded down to a page boundary. Returns -1 with errno set on failure,
+ * otherwise what the last call to fn returned. */
+int fd_residency(int fd, off_t offset, off_t len, residency_fn fn, void *arg)
+{
+    int PAGESIZE, ret = 0;
+    struct stat st;
+    void *file;
+    unsigned char *vec;
+    size_t window, nr_pages;
+    off_t pos, end;
+
+    PAGESIZE = getpagesize();
+
+    if(fstat(fd, &st) == -1)
+        return -1;
+    end = len && offset + len < st.st_size ? offset + len : st.st_size;
+    offset -= offset % PAGESIZE;
+    if(offset >= end)
+        return 0;
+
+    window = RESIDENCY_WINDOW;
+    if((off_t)window > end - offset)
+        window = end - offset;
+    vec = malloc((window + PAGESIZE - 1) / PAGESIZE);
+    if(!vec)
+        return -1;
+
+    for(pos = offset; pos < end && ret == 0; pos += window) {
+        if((off_t)window > end - pos)
+            window = end - pos;
+        nr_pages = (window + PAGESIZE - 1) / PAGESIZE;
+
+        file = mmap(NULL, window, PROT_NONE, MAP_SHARED, fd, pos);
+        if(file == MAP_FAILED) {
+            ret = -1;
+            break;
+        }
+        ret = mincore(file, window, vec);
+        munmap(file, window);
+        if(ret == 0)
+            ret = fn(pos, nr_pages, vec, arg);
+    }
+
+    free(vec);
+    return ret;
+}
+
+static int count_window(off_t pos, size_t nr_pages, const unsigned char *vec,
+    void *arg)
+{
+    *(size_t *)arg += count_resident(vec, nr_pages);
+    return 0;
+}
+
+/* Count the resident pages of [offset, offset+len), see fd_residency();
+ * with a single cachestat() if possible */
+int fd_count_resident(int fd, off_t offset, off_t len, size_t *cached)
+{
+    long long n;
+
+    if((n = fd_cached_pages(fd, offset, len)) >= 0) {
+        *cached = n;
+        return 0;
+    }
+    *cached = 0;
+    return fd_residency(fd, offset, len, count_window, cached);
+}
+
+struct evict_pass {
+    int fd, ret;
+    struct evict_stats *es;
+};
+
+/* Advise the runs of resident pages of a window away again. */
+static int evict_window(off_t pos, size_t nr_pages, const unsigned char *vec,
+    void *arg)
+{
+    struct evict_pass *p = arg;
+    size_t i = 0, end;
+    int PAGESIZE = getpagesize();
+
+    while((i = find_resident(vec, i, nr_pages, 1)) < nr_pages) {
+        end = find_resident(vec, i, nr_pages, 0);
+        p->es->fadvise++;
+        if((p->ret = posix_fadvise(p->fd, pos + (off_t)i * PAGESIZE,
+                        (off_t)(end - i) * PAGESIZE, POSIX_FADV_DONTNEED)))
+            return 1;
+        i = end;
+    }
+    return 0;
+}
+
+/* Drop [offset, offset+len) of fd (up to the end of the file if len is 0)
+ * from the cache with POSIX_FADV_DONTNEED, in up to max_passes passes. A
+ * single call may leave pages behind, e.g. ones that are still on a per-CPU
+ * LRU list or under writeback, so after each pass, the range is checked
+ * (with one cachestat() if possible), and if pages are left and passes
+ * remain, only the runs of pages that are still resident are advised again.
+ * The first retry comes right away, later ones after a pause of 1 ms,
+ * growing up to 16 ms. With a single pass, nothing is checked. DONTNEED
+ * keeps the pages the range covers only in part, so only the whole pages
+ * in between are checked and retried. Returns what posix_fadvise()
+ * returned. */
+int fd_evict_range(int fd, off_t offset, off_t len, int max_passes,
+    struct evict_stats *es)
+{
+    struct evict_pass p = { fd, 0, es };
+    struct timespec delay = { 0, 0 };
+    int pass, PAGESIZE = getpagesize();
+    off_t start, end;
+
+    es->fadvise = 1;
+    es->checks = 0;
+    es->left = 0;
+    if((p.ret = posix_fadvise(fd, offset, len, POSIX_FADV_DONTNEED)) ||
+            max_passes < 2)
+        return p.ret;
+
+    start = (offset + PAGESIZE - 1) / PAGESIZE * PAGESIZE;
+    end = (offset + len) / PAGESIZE * PAGESIZE;
+    if(len) {
+        if(end <= start)
+            return p.ret;
+        len = end - start;
+    }
+
+    for(pass = 2; ; pass++) {
+        es->checks++;
+        if(fd_count_resident(fd, start, len, &es->left) == -1 ||
+                es->left == 0 || pass > max_passes)
+            break;
+        if(pass > 2) {
+            delay.tv_nsec = 1000000L << (pass - 3 < 4 ? pass - 3 : 4);
+            nanosleep(&delay, NULL);
+        }
+        if(fd_residency(fd, start, len, evict_window, &p) == -1 || p.ret)
+            break;
+    }
+    return p.ret;
+}
@@ -0,0 +1,39 @@
+#ifndef _RESIDENCY_H
+#define _RESIDENCY_H
+
+#include <sys/types.h>
+#include <stddef.h>
+
+/* Page cache residency of file ranges for the command line tools. Ranges
+ * are mapped and checked RESIDENCY_WINDOW bytes at a time, so the memory
+ * needed does not depend on the size of the file. */
+
+#define RESIDENCY_WINDOW (64 * 1024 * 1024)
+
+/* Called for each window with the mincore() vector of its nr_pages pages,
+ * the first of which is at byte offset pos. A non-zero return value stops
+ * the scan and is returned by fd_residency(). */
+typedef int (*residency_fn)(off_t pos, size_t nr_pages,
+    const unsigned char *vec, void *arg);
+
+/* set to 0 to count pages with mincore() even if the kernel has
+ * cachestat(2); cleared by the first call that finds it missing */
+extern int residency_cachestat;
+
+/* what fd_evict_range() did */
+struct evict_stats {
+    unsigned int fadvise;  /* posix_fadvise() calls */
+    unsigned int checks;   /* times the range was checked */
+    size_t left;           /* pages still cached after the last check */
+};
+
+long long fd_cached_pages(int fd, off_t offset, off_t len);
+int fd_residency(int fd, off_t offset, off_t len, residency_fn fn, void *arg);
+int fd_count_resident(int fd, off_t offset, off_t len, size_t *cached);
+size_t count_resident(const unsigned char *vec, size_t n);
+size_t find_resident(const unsigned char *vec, size_t i, size_t n,
+    int resident);
+int fd_evict_range(int fd, off_t offset, off_t len, int max_passes,
+    struct evict_stats *es);
+
+#endif
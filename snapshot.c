@@ -0,0 +1,265 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "inode_hash.h"
+#include "residency.h"
+#include "snapshot.h"
+
+/* the runs of a file while it is scanned */
+struct encoder {
+    unsigned char *buf;
+    size_t len, size;
+    uint64_t next;       /* first page after the previous run */
+    uint64_t run_start;
+    int in_run;
+};
+
+static int put_number(struct encoder *e, uint64_t n)
+{
+    unsigned char *tmp;
+
+    if(e->size - e->len < 10) {
+        e->size = e->size ? 2 * e->size : 64;
+        if((tmp = realloc(e->buf, e->size)) == NULL)
+            return -1;
+        e->buf = tmp;
+    }
+    do {
+        e->buf[e->len++] = (n & 0x7f) | (n > 0x7f ? 0x80 : 0);
+        n >>= 7;
+    } while(n);
+    return 0;
+}
+
+static int put_run(struct encoder *e, uint64_t end)
+{
+    e->in_run = 0;
+    if(put_number(e, e->run_start - e->next) == -1 ||
+            put_number(e, end - e->run_start) == -1)
+        return -1;
+    e->next = end;
+    return 0;
+}
+
+static int encode_window(off_t pos, size_t nr_pages, const unsigned char *vec,
+    void *arg)
+{
+    struct encoder *e = arg;
+    uint64_t first = pos / getpagesize();
+    size_t i = 0;
+
+    while(i < nr_pages) {
+        i = find_resident(vec, i, nr_pages, !e->in_run);
+        if(i == nr_pages)
+            break;
+        if(e->in_run) {
+            if(put_run(e, first + i) == -1)
+                return -1;
+        } else {
+            e->in_run = 1;
+            e->run_start = first + i;
+        }
+    }
+    return 0;
+}
+
+FILE *snapshot_create(const char *file)
+{
+    FILE *fp;
+    struct snapshot_header h = { SNAPSHOT_MAGIC, getpagesize(), 0 };
+
+    if((fp = fopen(file, "w")) == NULL)
+        return NULL;
+    if(fwrite(&h, sizeof(h), 1, fp) != 1) {
+        fclose(fp);
+        return NULL;
+    }
+    return fp;
+}
+
+/* Append the residency of the regular file fd, opened as path, to the
+ * snapshot. Safe to call from several threads at once. */
+int snapshot_add(FILE *fp, const char *path, int fd, const struct stat *st)
+{
+    struct encoder e = { NULL, 0, 0, 0, 0, 0 };
+    struct snapshot_record r;
+    int ret = -1;
+
+    if(fd_residency(fd, 0, 0, encode_window, &e) == -1)
+        goto out;
+    if(e.in_run && put_run(&e, (st->st_size + getpagesize() - 1) /
+                getpagesize()) == -1)
+        goto out;
+
+    memset(&r, 0, sizeof(r));
+    r.dev = st->st_dev;
+    r.ino = st->st_ino;
+    r.size = st->st_size;
+    r.mtime_sec = st->st_mtim.tv_sec;
+    r.mtime_nsec = st->st_mtim.tv_nsec;
+    r.path_len = strlen(path);
+    r.runs_len = e.len;
+
+    flockfile(fp);
+    if(fwrite(&r, sizeof(r), 1, fp) == 1 &&
+            fwrite(path, 1, r.path_len, fp) == r.path_len &&
+            fwrite(e.buf, 1, e.len, fp) == e.len)
+        ret = 0;
+    funlockfile(fp);
+
+out:
+    free(e.buf);
+    return ret;
+}
+
+int snapshot_close(FILE *fp)
+{
+    int err = ferror(fp);
+
+    if(fclose(fp) == EOF || err)
+        return -1;
+    return 0;
+}
+
+struct snapshot *snapshot_load(const char *file)
+{
+    int fd;
+    struct stat st;
+    struct snapshot *s;
+    struct snapshot_header h;
+    struct snapshot_entry *e;
+    const unsigned char *p, *end;
+    size_t i, n, size = 0;
+
+    if((s = calloc(1, sizeof(*s))) == NULL)
+        return NULL;
+    if((fd = open(file, O_RDONLY)) == -1)
+        goto fail;
+    if(fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(h))
+        goto einval;
+    s->map_size = st.st_size;
+    s->map = mmap(NULL, s->map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(s->map == MAP_FAILED) {
+        s->map = NULL;
+        goto fail;
+    }
+    close(fd);
+    fd = -1;
+
+    memcpy(&h, s->map, sizeof(h));
+    if(memcmp(h.magic, SNAPSHOT_MAGIC, sizeof(h.magic)))
+        goto einval;
+    s->page_size = h.page_size;
+
+    p = (unsigned char *)s->map + sizeof(h);
+    end = (unsigned char *)s->map + s->map_size;
+    while(p < end) {
+        if(s->nr_entries == size) {
+            size = size ? 2 * size : 64;
+            if((e = realloc(s->entries, size * sizeof(*e))) == NULL)
+                goto fail;
+            s->entries = e;
+        }
+        e = &s->entries[s->nr_entries];
+        if((size_t)(end - p) < sizeof(e->rec))
+            goto einval;
+        memcpy(&e->rec, p, sizeof(e->rec));
+        p += sizeof(e->rec);
+        if((uint64_t)(end - p) < e->rec.path_len + e->rec.runs_len)
+            goto einval;
+        e->path = (const char *)p;
+        e->runs = p + e->rec.path_len;
+        p += e->rec.path_len + e->rec.runs_len;
+        s->nr_entries++;
+    }
+
+    s->hash_size = 16;
+    while(s->hash_size < 2 * s->nr_entries)
+        s->hash_size *= 2;
+    if((s->by_inode = calloc(s->hash_size, sizeof(*s->by_inode))) == NULL)
+        goto fail;
+    for(n = 0; n < s->nr_entries; n++) {
+        e = &s->entries[n];
+        i = (inode_hash(e->rec.dev, e->rec.ino) >> 17) & (s->hash_size - 1);
+        while(s->by_inode[i])
+            i = (i + 1) & (s->hash_size - 1);
+        s->by_inode[i] = n + 1;
+    }
+    return s;
+
+einval:
+    errno = EINVAL;
+fail:
+    if(fd != -1)
+        close(fd);
+    snapshot_free(s);
+    return NULL;
+}
+
+/* The last entry recorded for an inode, or NULL */
+const struct snapshot_entry *snapshot_find_inode(const struct snapshot *s,
+    dev_t dev, ino_t ino)
+{
+    const struct snapshot_entry *e, *found = NULL;
+    size_t i = (inode_hash(dev, ino) >> 17) & (s->hash_size - 1);
+
+    for(; s->by_inode[i]; i = (i + 1) & (s->hash_size - 1)) {
+        e = &s->entries[s->by_inode[i] - 1];
+        if(e->rec.dev == dev && e->rec.ino == ino &&
+                (!found || e > found))
+            found = e;
+    }
+    return found;
+}
+
+void snapshot_runs_init(struct snapshot_runs *it,
+    const struct snapshot_entry *e)
+{
+    it->p = e->runs;
+    it->end = e->runs + e->rec.runs_len;
+    it->page = 0;
+}
+
+static int get_number(struct snapshot_runs *it, uint64_t *n)
+{
+    int shift;
+
+    for(*n = 0, shift = 0; it->p < it->end && shift < 64; shift += 7) {
+        *n |= (uint64_t)(*it->p & 0x7f) << shift;
+        if(!(*it->p++ & 0x80))
+            return 1;
+    }
+    return 0;
+}
+
+/* Get the next run of resident pages; returns 0 at the end */
+int snapshot_next_run(struct snapshot_runs *it, uint64_t *start,
+    uint64_t *len)
+{
+    uint64_t gap;
+
+    if(!get_number(it, &gap) || !get_number(it, len))
+        return 0;
+    *start = it->page + gap;
+    it->page = *start + *len;
+    return 1;
+}
+
+void snapshot_free(struct snapshot *s)
+{
+    if(!s)
+        return;
+    if(s->map)
+        munmap(s->map, s->map_size);
+    free(s->entries);
+    free(s->by_inode);
+    free(s);
+}
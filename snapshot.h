@@ -0,0 +1,67 @@
+#ifndef _SNAPSHOT_H
+#define _SNAPSHOT_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* A snapshot records which pages of a set of files were in the page cache.
+ * It is a struct snapshot_header followed by a struct snapshot_record per
+ * file, each followed by path_len bytes of path and runs_len bytes of runs
+ * of resident pages. A run is two LEB128 numbers: the pages since the end
+ * of the previous run and the length of the run. Everything is in host
+ * byte order. */
+
+#define SNAPSHOT_MAGIC "nocsnap1"
+
+struct snapshot_header {
+    char magic[8];
+    uint32_t page_size;
+    uint32_t reserved;
+};
+
+struct snapshot_record {
+    uint64_t dev, ino, size;
+    int64_t mtime_sec;
+    uint32_t mtime_nsec;
+    uint32_t path_len;
+    uint64_t runs_len;
+};
+
+struct snapshot_entry {
+    struct snapshot_record rec;
+    const char *path;             /* not NUL-terminated */
+    const unsigned char *runs;
+};
+
+struct snapshot {
+    void *map;
+    size_t map_size;
+    uint32_t page_size;
+    struct snapshot_entry *entries;
+    size_t nr_entries;
+    /* open addressing by inode: index + 1 into entries, 0 if free */
+    size_t *by_inode;
+    size_t hash_size;
+};
+
+struct snapshot_runs {
+    const unsigned char *p, *end;
+    uint64_t page;
+};
+
+FILE *snapshot_create(const char *file);
+int snapshot_add(FILE *fp, const char *path, int fd, const struct stat *st);
+int snapshot_close(FILE *fp);
+
+struct snapshot *snapshot_load(const char *file);
+const struct snapshot_entry *snapshot_find_inode(const struct snapshot *s,
+    dev_t dev, ino_t ino);
+void snapshot_runs_init(struct snapshot_runs *it,
+    const struct snapshot_entry *e);
+int snapshot_next_run(struct snapshot_runs *it, uint64_t *start,
+    uint64_t *len);
+void snapshot_free(struct snapshot *s);
+
+#endif
@@ -0,0 +1,127 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "stats.h"
+
+int stats_enabled;
+uint64_t stats_counters[NR_STATS];
+
+static char *stats_file;
+
+static const char *counter_names[NR_STATS] = {
+    [STAT_FILES_TRACKED] = "files_tracked",
+    [STAT_PAGES_CACHED] = "pages_cached_at_open",
+    [STAT_PAGES_ADVISED] = "pages_advised",
+    [STAT_FADVISE] = "fadvise_calls",
+    [STAT_FDATASYNC] = "fdatasync_calls",
+    [STAT_SYNC_FILE_RANGE] = "sync_file_range_calls",
+    [STAT_MINCORE] = "mincore_calls",
+    [STAT_CACHESTAT] = "cachestat_calls",
+    [STAT_FILES_SHARED] = "files_shared",
+    [STAT_REGISTRY_HITS] = "registry_hits",
+    [STAT_BUDGET_DROPS] = "budget_drops",
+    [STAT_PRESSURE_EVICT] = "pressure_evict",
+    [STAT_PRESSURE_PARTIAL] = "pressure_partial",
+    [STAT_PRESSURE_KEEP] = "pressure_keep",
+    [STAT_EVICT_CHECKS] = "evict_checks",
+    [STAT_PAGES_LEFT] = "pages_left_cached",
+    [STAT_PAGES_COALESCED] = "pages_coalesced",
+};
+
+static const char *timer_names[NR_TIMERS] = {
+    [TIMER_STORE_PAGEINFO] = "store_pageinfo",
+    [TIMER_FREE_UNCLAIMED] = "free_unclaimed_pages",
+    [TIMER_EVICT] = "evict",
+    [TIMER_TOUCH_PAGEINFO] = "touch_pageinfo",
+    [TIMER_DROP_BEHIND] = "drop_behind",
+    [TIMER_WRITE_BEHIND] = "write_behind",
+    [TIMER_BUDGET] = "budget",
+};
+
+static struct {
+    uint64_t calls;
+    uint64_t total_ns;
+    uint64_t hist[STATS_BUCKETS];
+} timers[NR_TIMERS];
+
+void stats_stop(enum stats_timer t, uint64_t start)
+{
+    int bucket;
+    uint64_t ns;
+
+    if(start == 0)
+        return;
+    ns = stats_start() - start;
+    bucket = ns ? 63 - __builtin_clzll(ns) : 0;
+    if(bucket >= STATS_BUCKETS)
+        bucket = STATS_BUCKETS - 1;
+
+    __atomic_add_fetch(&timers[t].calls, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&timers[t].total_ns, ns, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&timers[t].hist[bucket], 1, __ATOMIC_RELAXED);
+}
+
+void stats_init(const char *file)
+{
+    if((stats_file = strdup(file)) != NULL)
+        stats_enabled = 1;
+}
+
+/* In a forked child, start from zero, or the parent's numbers would be
+ * reported twice. */
+void stats_reset(void)
+{
+    memset(stats_counters, 0, sizeof(stats_counters));
+    memset(timers, 0, sizeof(timers));
+}
+
+/* Append this process's numbers to the stats file as one JSON object on a
+ * line of its own. The line is written with a single write() to an
+ * O_APPEND fd, so processes sharing the file don't mix up their output. */
+void stats_dump(void)
+{
+    int i, j, fd;
+    char buf[8192];
+    size_t n = 0;
+
+    if(!stats_enabled)
+        return;
+
+#define OUT(...) \
+    do { \
+        if(n < sizeof(buf)) \
+            n += snprintf(buf + n, sizeof(buf) - n, __VA_ARGS__); \
+    } while(0)
+
+    OUT("{\"pid\":%d", (int)getpid());
+    for(i = 0; i < NR_STATS; i++)
+        OUT(",\"%s\":%llu", counter_names[i],
+            (unsigned long long)stats_counters[i]);
+    OUT(",\"hooks\":{");
+    for(i = 0; i < NR_TIMERS; i++) {
+        OUT("%s\"%s\":{\"calls\":%llu,\"total_ns\":%llu,\"hist_log2_ns\":[",
+            i ? "," : "", timer_names[i],
+            (unsigned long long)timers[i].calls,
+            (unsigned long long)timers[i].total_ns);
+        for(j = 0; j < STATS_BUCKETS; j++)
+            OUT("%s%llu", j ? "," : "", (unsigned long long)timers[i].hist[j]);
+        OUT("]}");
+    }
+    OUT("}}\n");
+#undef OUT
+
+    if(n >= sizeof(buf))
+        return;
+    if((fd = open(stats_file, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644)) == -1)
+        return;
+    if(write(fd, buf, n) != (ssize_t)n)
+        fprintf(stderr, "[nocache] could not write stats to %s\n", stats_file);
+    close(fd);
+}
+
+/* vim:set et sw=4 ts=4: */
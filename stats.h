@@ -0,0 +1,70 @@
+#ifndef _STATS_H
+#define _STATS_H
+
+#include <stdint.h>
+#include <time.h>
+
+/* Counters and hook latency histograms, kept only if NOCACHE_STATS is set
+ * and written to that file as one line of JSON per process at exit. */
+
+enum stats_counter {
+    STAT_FILES_TRACKED,
+    STAT_PAGES_CACHED,     /* pages found cached when files were scanned */
+    STAT_PAGES_ADVISED,    /* pages passed to fadvise(DONTNEED) */
+    STAT_FADVISE,
+    STAT_FDATASYNC,
+    STAT_SYNC_FILE_RANGE,
+    STAT_MINCORE,
+    STAT_CACHESTAT,
+    STAT_FILES_SHARED,     /* opens of files that were open already */
+    STAT_REGISTRY_HITS,    /* files another process had scanned already */
+    STAT_BUDGET_DROPS,     /* extents dropped to stay within the budget */
+    STAT_PRESSURE_EVICT,   /* adaptive: closes that dropped everything */
+    STAT_PRESSURE_PARTIAL, /* adaptive: closes that dropped part of it */
+    STAT_PRESSURE_KEEP,    /* adaptive: closes that dropped nothing */
+    STAT_EVICT_CHECKS,     /* ranges checked for pages fadvise left behind */
+    STAT_PAGES_LEFT,       /* pages still cached after the last check */
+    STAT_PAGES_COALESCED,  /* cached pages dropped along with merged ranges */
+    NR_STATS
+};
+
+enum stats_timer {
+    TIMER_STORE_PAGEINFO,  /* open, dup */
+    TIMER_FREE_UNCLAIMED,  /* close */
+    TIMER_EVICT,           /* writeback and fadvise at close */
+    TIMER_TOUCH_PAGEINFO,  /* read, write in lazy mode */
+    TIMER_DROP_BEHIND,     /* read, write in drop-behind mode */
+    TIMER_WRITE_BEHIND,    /* write in write-behind mode */
+    TIMER_BUDGET,          /* read, write in budget mode */
+    NR_TIMERS
+};
+
+/* bucket n counts calls that took [2^n, 2^(n+1)) nanoseconds */
+#define STATS_BUCKETS 32
+
+extern int stats_enabled;
+extern uint64_t stats_counters[NR_STATS];
+
+static inline void stats_add(enum stats_counter c, uint64_t n)
+{
+    if(stats_enabled)
+        __atomic_add_fetch(&stats_counters[c], n, __ATOMIC_RELAXED);
+}
+
+/* Returns a timestamp to pass to stats_stop(), or 0 if stats are off. */
+static inline uint64_t stats_start(void)
+{
+    struct timespec ts;
+
+    if(!stats_enabled)
+        return 0;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void stats_stop(enum stats_timer t, uint64_t start);
+void stats_init(const char *file);
+void stats_reset(void);
+void stats_dump(void);
+
+#endif
@@ -0,0 +1,16 @@
+#!/bin/sh
+
+NR=0
+
+. ./testlib.sh
+
+echo 1..5
+
+t "dd if=/dev/zero of=testfile.$$ bs=1M count=4 2>/dev/null && sync testfile.$$ && ../cachestats -q testfile.$$" "file is cached"
+t "while ../cachestats -q testfile.$$; do ../cachedel testfile.$$ && sleep 1; done" "file is not cached any more"
+t "env NOCACHE_ASYNC=16 NOCACHE_DEBUGFD=3 LD_PRELOAD=../nocache.so cat testfile.$$ >/dev/null 3>testfile.$$.log && grep -q 'async_worker: evicting' testfile.$$.log" "pages are dropped by the background thread"
+t "! ../cachestats -q testfile.$$" "file is not in cache"
+t "timeout 120 env NOCACHE_ASYNC=4 LD_PRELOAD=../nocache.so ../bench/openclose -t 16 -n 2000 -r testfile.$$ >/dev/null" "concurrent open/close with a small queue works"
+
+# clean up
+rm -f testfile.$$ testfile.$$.log
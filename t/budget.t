@@ -0,0 +1,19 @@
+#!/bin/sh
+
+NR=0
+
+. ./testlib.sh
+
+echo 1..8
+
+t "for f in a b; do dd if=/dev/urandom of=testfile.$$.\$f bs=1M count=4 2>/dev/null; done && while ../cachestats -q testfile.$$.a || ../cachestats -q testfile.$$.b; do ../cachedel testfile.$$.a && ../cachedel testfile.$$.b && sleep 1; done" "files are not cached"
+t "env NOCACHE_BUDGET=8M LD_PRELOAD=../nocache.so ../bench/reread -c '../cachestats -q testfile.$$.a && ../cachestats -q testfile.$$.b' testfile.$$.a testfile.$$.b" "closed files are kept within the budget"
+t "! ../cachestats -q testfile.$$.a && ! ../cachestats -q testfile.$$.b" "they are dropped at exit"
+t "env NOCACHE_BUDGET=5M LD_PRELOAD=../nocache.so ../bench/reread -c '! ../cachestats -q testfile.$$.a && ../cachestats -q testfile.$$.b' testfile.$$.a testfile.$$.b" "the file read first is dropped to fit the budget"
+t "env NOCACHE_BUDGET=8M NOCACHE_STATS=testfile.$$.json LD_PRELOAD=../nocache.so ../bench/reread -r 3 testfile.$$.a testfile.$$.b >/dev/null && grep -q '\"files_shared\":4,' testfile.$$.json && grep -q '\"budget_drops\":0,' testfile.$$.json" "files read again are found in the budget"
+t "env NOCACHE_BUDGET=8M LD_PRELOAD=../nocache.so ../bench/reread -c 'for f in \$(find /proc/\$PPID/fd -lname \"*/testfile.$$.a\"); do [ \${f##*/} -ge 512 ] || exit 1; done; [ -n \"\$f\" ]' testfile.$$.a" "the fd kept to drop extents with is not a low one"
+t "env NOCACHE_BUDGET=8M LD_PRELOAD=../nocache.so sh -c \"../bench/reread -c '! ../cachestats -q testfile.$$.a' testfile.$$.a || exit 1\"" "a process started by the one with the budget has none of its own"
+t "! ../nocache -B 8M -S true 2>/dev/null && ! ../nocache -B 8M -l 1M true 2>/dev/null" "-B is rejected along with -S or -l"
+
+# clean up
+rm -f testfile.$$.a testfile.$$.b testfile.$$.json
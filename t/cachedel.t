@@ -0,0 +1,24 @@
+#!/bin/sh
+
+NR=0
+
+. ./testlib.sh
+
+echo 1..7
+
+D=testdir.$$
+mkdir -p $D/sub
+dd if=/dev/zero of=$D/a bs=1M count=4 2>/dev/null
+dd if=/dev/zero of=$D/sub/b bs=1M count=1 2>/dev/null
+sync $D/a $D/sub/b
+
+t "cat $D/a $D/sub/b >/dev/null && ../cachedel -j 2 $D && ! ../cachestats -q $D/a && ! ../cachestats -q $D/sub/b" "directories are evicted recursively"
+t "cat $D/a >/dev/null && ../cachedel --offset 1M --length 1M $D/a && ../cachestats $D/a | grep -q '^pages in cache: 768/1024 '" "only the given range is evicted"
+t "cat $D/a >/dev/null && ../cachesnap save $D.snap $D && cat $D/sub/b >/dev/null && ../cachedel -s $D.snap $D && ../cachestats -q $D/a && ! ../cachestats -q $D/sub/b" "pages cached in the snapshot are kept"
+t "cat $D/a >/dev/null && touch $D/a && ../cachedel -s $D.snap $D/a && ! ../cachestats -q $D/a" "files changed since the snapshot are dropped completely"
+t "cat $D/sub/b >/dev/null && ../cachedel -v $D/sub/b | grep -qx 'pages freed: 256/256 (0 still cached)  $D/sub/b'" "-v reports the pages freed"
+t "cat $D/a >/dev/null && ../cachedel -n 8 -v $D/a | grep -q '(0 still cached)'" "-n retries until nothing is left"
+t "cat $D/sub/b >/dev/null && ../cachedel -n 4 -o 2048 -l 8192 $D/sub/b && ../cachestats $D/sub/b | grep -q '^pages in cache: 255/256 '" "retries keep the pages the range covers in part"
+
+# clean up
+rm -rf $D $D.snap
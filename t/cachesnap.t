@@ -0,0 +1,25 @@
+#!/bin/sh
+
+NR=0
+
+. ./testlib.sh
+
+echo 1..5
+
+D=testdir.$$
+mkdir -p $D/sub
+dd if=/dev/zero of=$D/a bs=1M count=8 2>/dev/null
+dd if=/dev/zero of=$D/sub/b bs=1M count=1 2>/dev/null
+sync $D/a $D/sub/b
+../cachedel $D
+dd if=$D/a of=/dev/null bs=1M skip=6 count=1 2>/dev/null
+cat $D/sub/b >/dev/null
+
+t "../cachestats -j 1 $D >$D.before && ../cachesnap save -j 2 $D.snap $D && ../cachedel $D && ! ../cachestats -q $D/sub/b" "snapshot is saved"
+t "../cachesnap restore -d 2 $D.snap >/dev/null && ../cachestats -j 1 $D | diff $D.before -" "restore brings back exactly the pages cached before"
+t "touch $D/sub/b && ../cachedel $D && ../cachesnap restore $D.snap 2>&1 | grep -q 'sub/b: changed since the snapshot' && ! ../cachestats -q $D/sub/b" "files changed since the snapshot are skipped"
+t "../cachedel $D && (cd / && $PWD/../cachesnap restore $PWD/$D.snap 2>/dev/null) | grep -q 'files restored: 1/2 (1 changed since the snapshot, 0 failed)' && ../cachestats $D/a | grep -q 'pages in cache: 256/'" "a snapshot of a relative path is restored from another directory"
+t "../cachedel $D && ../cachesnap restore -s $D.snap 2>&1 | grep -q 'files restored: 2/2 (0 changed since the snapshot, 0 failed)' && ../cachestats -q $D/sub/b" "with -s, a file with another mtime but the same size is restored"
+
+# clean up
+rm -rf $D $D.snap $D.before
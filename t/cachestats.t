@@ -0,0 +1,25 @@
+#!/bin/sh
+
+NR=0
+
+. ./testlib.sh
+
+echo 1..7
+
+D=testdir.$$
+mkdir -p $D/sub
+dd if=/dev/zero of=$D/a bs=1M count=1 2>/dev/null
+dd if=/dev/zero of=$D/sub/b bs=1M count=2 2>/dev/null
+echo x > "$D/sub/c,\"d"
+sync $D/a $D/sub/b
+
+t "../cachestats -q $D && ../cachedel $D/sub/b && ! ../cachestats -q $D" "exit code tells if all files in a tree are cached"
+t "../cachestats -j 3 $D | tail -n 1 | grep -q '/769 .*  total\$'" "totals add up over the tree"
+t "[ \$(../cachestats -d $D | grep -c ' $D/sub\$') = 1 ] && ! ../cachestats -d $D | grep -q ' $D/a\$'" "-d prints directories instead of files"
+t "../cachestats -t 1 -J $D $D/sub/b | grep -q '^{\"type\":\"file\",\"path\":\"$D/a\",\"size\":1048576,\"pages\":256,\"cached\":256}\$'" "-t prints the files with most pages cached"
+t "../cachestats -c $D/sub | grep -qx 'file,\"$D/sub/c,\"\"d\",2,1,1'" "CSV quotes paths"
+t "dd if=/dev/zero of=$D/m bs=1M count=4 2>/dev/null && sync $D/m && cat $D/m >/dev/null && ../cachedel -o 1M -l 1M $D/m && [ \"\$(../cachestats -R $D/m | tr '\\n' ' ')\" = '0 1048576 2097152 2097152 ' ]" "-R prints the cached ranges"
+t "../cachestats -v -r 64 $D/m | grep -qx '     0: |xxxx    xxxxxxxx|'" "-v -r aggregates pages into cells"
+
+# clean up
+rm -rf $D
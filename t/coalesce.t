@@ -0,0 +1,20 @@
+#!/bin/sh
+
+NR=0
+
+. ./testlib.sh
+
+echo 1..5
+
+ranges() {
+    grep -c 'fadv_dontneed(fd=' testfile.$$.log
+}
+
+t "dd if=/dev/zero of=testfile.$$ bs=1M count=32 2>/dev/null && sync testfile.$$ && ../cachestats -q testfile.$$" "file is cached"
+t "while ../cachestats -q testfile.$$; do ../cachedel testfile.$$ && sleep 1; done" "file is not cached any more"
+t "dd if=testfile.$$ of=/dev/null bs=4k skip=4096 count=1 2>/dev/null && env NOCACHE_DEBUGFD=3 LD_PRELOAD=../nocache.so cat testfile.$$ >/dev/null 3>testfile.$$.log && [ \$(ranges) -eq 2 ]" "uncached ranges around a cached island are dropped separately"
+t "dd if=testfile.$$ of=/dev/null bs=4k skip=4096 count=1 2>/dev/null && env NOCACHE_MAX_FADVISE=1 NOCACHE_DEBUGFD=3 LD_PRELOAD=../nocache.so cat testfile.$$ >/dev/null 3>testfile.$$.log && [ \$(ranges) -eq 1 ] && grep -q 'cached pages sacrificed' testfile.$$.log" "they are merged if only one fadvise call is allowed"
+t "../cachestats testfile.$$ | grep -q 'pages in cache: 0/'" "the cached island was dropped, too"
+
+# clean up
+rm -f testfile.$$ testfile.$$.log
@@ -0,0 +1,15 @@
+#!/bin/sh
+
+NR=0
+
+. ./testlib.sh
+
+echo 1..4
+
+t "dd if=/dev/zero of=testfile.$$ bs=1M count=4 2>/dev/null && sync testfile.$$ && ../cachestats -q testfile.$$" "file is cached"
+t "while ../cachestats -q testfile.$$; do ../cachedel testfile.$$ && sleep 1; done" "file is not cached any more"
+t "env NOCACHE_DROPBEHIND=256K NOCACHE_DEBUGFD=3 LD_PRELOAD=../nocache.so dd if=testfile.$$ of=/dev/null bs=64k 2>/dev/null 3>testfile.$$.log && grep -q 'drop_behind(fd=0' testfile.$$.log" "pages are dropped while the file is being read"
+t "! ../cachestats -q testfile.$$" "file is not in cache"
+
+# clean up
+rm -f testfile.$$ testfile.$$.log
@@ -0,0 +1,14 @@
+#!/bin/sh
+
+NR=0
+
+. ./testlib.sh
+
+echo 1..3
+
+t "echo test > testfile.$$ && while ../cachestats -q testfile.$$; do ../cachedel testfile.$$ && sleep 1; done" "file is not cached"
+t "env LD_PRELOAD=../nocache.so sh -c '(exec 3<testfile.$$; (cat <&3 >/dev/null; exec 3<&-); exec 3<&-)' && ! ../cachestats -q testfile.$$" "a forked child closing an inherited fd evicts the file"
+t "env LD_PRELOAD=../nocache.so timeout 60 ../bench/forkstorm -n 200 -k 300 -t 4 testfile.$$ >/dev/null" "forking while other threads open files does not hang"
+
+# clean up
+rm -f testfile.$$
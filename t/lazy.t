@@ -0,0 +1,19 @@
+#!/bin/sh
+
+NR=0
+
+. ./testlib.sh
+
+echo 1..8
+
+t "dd if=/dev/zero of=testfile.$$ bs=1M count=32 2>/dev/null && sync testfile.$$ && ../cachestats -q testfile.$$" "file is cached"
+t "while ../cachestats -q testfile.$$; do ../cachedel testfile.$$ && sleep 1; done" "file is not cached any more"
+t "env NOCACHE_LAZY=1M NOCACHE_DEBUGFD=3 LD_PRELOAD=../nocache.so dd if=testfile.$$ of=/dev/null bs=64k skip=256 count=16 2>/dev/null 3>testfile.$$.log && grep -q 'scanning segment 16' testfile.$$.log && ! grep -q 'scanning segment 0' testfile.$$.log" "only the part of the file that is read is scanned"
+t "../cachestats testfile.$$ | grep -q 'pages in cache: 0/'" "file is still not in cache"
+t "env NOCACHE_LAZY=1M NOCACHE_DEBUGFD=3 LD_PRELOAD=../nocache.so tail -c 1M testfile.$$ 3>testfile.$$.log >/dev/null && grep -q 'scanning segment 31' testfile.$$.log && ! grep -q 'scanning segment 0' testfile.$$.log" "a seek is followed"
+t "env NOCACHE_LAZY=1M NOCACHE_DEBUGFD=3 LD_PRELOAD=../nocache.so head -c 24M testfile.$$ 3>testfile.$$.log >/dev/null && grep -q 'scanning segment 23' testfile.$$.log" "reads are followed without asking for the position"
+t "while ../cachestats -q testfile.$$; do ../cachedel testfile.$$ && sleep 1; done && env NOCACHE_LAZY=1M NOCACHE_DEBUGFD=3 LD_PRELOAD=../nocache.so ../bench/reread -d testfile.$$ 3>testfile.$$.log >/dev/null && grep -q 'scanning segment 31' testfile.$$.log" "reads through a duplicate made with fcntl() are followed"
+t "../cachestats testfile.$$ | grep -q 'pages in cache: 0/'" "all that was read is dropped"
+
+# clean up
+rm -f testfile.$$ testfile.$$.log
@@ -4,13 +4,15 @@ NR=0
 
 . ./testlib.sh
 
-echo 1..5
+echo 1..7
 
 t "echo test > testfile.$$ && ../cachestats -q testfile.$$" "file is cached"
 t "while ../cachestats -q testfile.$$; do ../cachedel testfile.$$ && sleep 1; done" "file is not cached any more"
 t "env NOCACHE_MAX_FDS=3 LD_PRELOAD=../nocache.so cat testfile.$$ >/dev/null && ../cachestats -q testfile.$$" "file is in cache because it has an FD >= 3"
 t "while ../cachestats -q testfile.$$; do ../cachedel testfile.$$ && sleep 1; done" "file is not cached any more"
 t "env NOCACHE_MAX_FDS=4 LD_PRELOAD=../nocache.so cat testfile.$$ >/dev/null && ! ../cachestats -q testfile.$$" "file is not in cache because it has an FD < 4"
+t "while ../cachestats -q testfile.$$; do ../cachedel testfile.$$ && sleep 1; done" "file is not cached any more"
+t "env LD_PRELOAD=../nocache.so bash -c 'ulimit -n 8192 && exec 5000<testfile.$$ && while read -u 5000 l; do :; done && exec 5000<&-' && ! ../cachestats -q testfile.$$" "a high fd is tracked, too"
 
 # clean up
 rm -f testfile.$$
@@ -0,0 +1,17 @@
+#!/bin/sh
+
+NR=0
+
+. ./testlib.sh
+
+echo 1..6
+
+t "dd if=/dev/zero of=testfile.$$ bs=1M count=4 2>/dev/null && sync testfile.$$ && ../cachestats -q testfile.$$" "file is cached"
+t "printf '# comment\nignore /nonexistent/\nflushall $PWD/\n' > testfile.$$.policy && env NOCACHE_POLICY=testfile.$$.policy LD_PRELOAD=../nocache.so cat testfile.$$ >/dev/null && ! ../cachestats -q testfile.$$" "a file matching a flushall prefix rule (by relative path) is dropped although it was cached"
+t "printf 'ignore * min=1M max=8M\n' > testfile.$$.policy && env NOCACHE_POLICY=testfile.$$.policy LD_PRELOAD=../nocache.so cat testfile.$$ >/dev/null && ../cachestats -q testfile.$$" "a file matching an ignore rule is not dropped"
+t "while ../cachestats -q testfile.$$; do ../cachedel testfile.$$ && sleep 1; done" "file is not cached any more"
+t "printf 'ignore *.$$ flags=write\nignore * max=1M\ntrack *\n' > testfile.$$.policy && env NOCACHE_POLICY=testfile.$$.policy LD_PRELOAD=../nocache.so cat testfile.$$ >/dev/null && ! ../cachestats -q testfile.$$" "a file matching no ignore rule is tracked"
+t "printf 'ignore $PWD/testfile\n' > testfile.$$.policy && env NOCACHE_POLICY=testfile.$$.policy LD_PRELOAD=../nocache.so cat testfile.$$ >/dev/null && ! ../cachestats -q testfile.$$" "a prefix rule only matches whole path components"
+
+# clean up
+rm -f testfile.$$ testfile.$$.policy
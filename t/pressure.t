@@ -0,0 +1,40 @@
+#!/bin/sh
+
+NR=0
+
+. ./testlib.sh
+
+echo 1..6
+
+# A fake /proc and /sys/fs/cgroup: the process is in job/task, which has no
+# limit of its own, but job has one of 1G.
+R=testroot.$$
+mkdir -p $R/proc/self $R/proc/pressure $R/sys/fs/cgroup/job/task
+echo "0::/job/task" > $R/proc/self/cgroup
+echo max > $R/sys/fs/cgroup/job/task/memory.max
+echo 1073741824 > $R/sys/fs/cgroup/job/memory.max
+printf 'anon 104857600\ninactive_file 104857600\n' > $R/sys/fs/cgroup/job/memory.stat
+pressure() {
+    echo "some avg10=$1 avg60=0.00 avg300=0.00 total=0" > $R/proc/pressure/memory
+    echo $2 > $R/sys/fs/cgroup/job/memory.current
+}
+uncache() {
+    while ../cachestats -q testfile.$$; do ../cachedel testfile.$$ && sleep 1; done
+}
+cached() {
+    ../cachestats testfile.$$ | sed 's/^pages in cache: \([0-9]*\)\/.*/\1/'
+}
+nocache_cat() {
+    rm -f testfile.$$.json
+    env NOCACHE_PRESSURE="$1" NOCACHE_PRESSURE_ROOT=$R NOCACHE_STATS=testfile.$$.json LD_PRELOAD=../nocache.so cat testfile.$$ >/dev/null
+}
+
+t "dd if=/dev/urandom of=testfile.$$ bs=1M count=4 2>/dev/null && sync testfile.$$ && uncache" "file is not cached"
+t "pressure 0.00 314572800 && nocache_cat && ../cachestats -q testfile.$$ && grep -q '\"pressure_keep\":1,' testfile.$$.json" "pages are kept without memory pressure"
+t "uncache && pressure 0.00 856476877 && nocache_cat && n=\$(cached) && [ \$n -gt 400 ] && [ \$n -lt 624 ] && grep -q '\"pressure_partial\":1,' testfile.$$.json" "half of them are dropped at 70% of the cgroup's limit"
+t "uncache && pressure 20.00 314572800 && nocache_cat && ! ../cachestats -q testfile.$$ && grep -q '\"pressure_evict\":1,' testfile.$$.json" "all of them are dropped when tasks stall on memory"
+t "uncache && pressure 5.00 314572800 && nocache_cat 'psi=10:20,mem=50:90' && ../cachestats -q testfile.$$" "thresholds can be set"
+t "uncache && rm -rf $R/proc $R/sys && nocache_cat && ! ../cachestats -q testfile.$$ && grep -q '\"pressure_evict\":1,' testfile.$$.json" "all of them are dropped if nothing can be read"
+
+# clean up
+rm -rf testfile.$$ testfile.$$.json $R
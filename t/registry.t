@@ -0,0 +1,23 @@
+#!/bin/sh
+
+NR=0
+
+. ./testlib.sh
+
+echo 1..12
+
+t "dd if=/dev/urandom of=testfile.$$ bs=4k count=64 2>/dev/null && while ../cachestats -q testfile.$$; do ../cachedel testfile.$$ && sleep 1; done" "file is not cached"
+t "../nocache -S sh -c 'exec 3<testfile.$$; cat testfile.$$ >/dev/null; ../cachestats -q testfile.$$; r=\$?; exec 3<&-; exit \$r'" "a child closing a file its parent has open keeps its pages"
+t "! ../cachestats -q testfile.$$" "the last close in the tree drops them"
+t "env NOCACHE_STATS=testfile.$$.json ../nocache -S sh -c 'exec 3<testfile.$$; cat testfile.$$ >/dev/null; exec 3<&-' && grep -q '\"cachestat_calls\":0,\"files_shared\":0,\"registry_hits\":1,' testfile.$$.json" "the child does not scan the file again"
+t "while ../cachestats -q testfile.$$; do ../cachedel testfile.$$ && sleep 1; done && ../nocache -S sh -c 'exec 3<testfile.$$; (sleep .3; cat testfile.$$ >/dev/null) & exec 3<&-; wait'" "a forked child execs and reads the file after its parent closed it"
+t "! ../cachestats -q testfile.$$" "the exec'd program's close drops them"
+t "while ../cachestats -q testfile.$$; do ../cachedel testfile.$$ && sleep 1; done && ../nocache -S bash -c 'exec 3<testfile.$$; cat testfile.$$ >/dev/null; (exec sleep .5) & exec 3<&-; sleep .2; ../cachestats -q testfile.$$; r=\$?; wait; exit \$r'" "a program exec'd with the file open keeps its pages after the parent closed it"
+t "! ../cachestats -q testfile.$$" "they are dropped when it exits"
+t "../nocache -S bash -c 'exec 3<testfile.$$; cat testfile.$$ >/dev/null; for i in \$(seq 24); do (exec sleep .5) & done; exec 3<&-; sleep .2; ../cachestats -q testfile.$$; r=\$?; wait; exit \$r'" "more processes than fit into an entry hold the file"
+t "! ../cachestats -q testfile.$$" "the last of them to exit drops its pages"
+t "dd if=/dev/urandom of=testfile.$$.frag bs=4k count=200 2>/dev/null && sync testfile.$$.frag && cat testfile.$$.frag >/dev/null && for i in \$(seq 0 2 199); do ../cachedel -o \$((i*4096)) -l 4096 testfile.$$.frag; done && ../nocache -S bash -c 'exec 3<testfile.$$.frag; (exec 3<&-; exec 4<testfile.$$.frag; cat testfile.$$.frag >/dev/null; sleep .3; exec 4<&-) & sleep .1; exec 3<&-; wait' && ../cachestats testfile.$$.frag | grep -q 'pages in cache: 100/'" "a file with more uncached ranges than fit into an entry keeps the pages cached at open"
+t "f=\$(../nocache -S sh -c 'echo \$NOCACHE_SHARED') && [ -n \"\$f\" ] && [ ! -e \"\$f\" ]" "the registry is removed afterwards"
+
+# clean up
+rm -f testfile.$$ testfile.$$.frag testfile.$$.json
@@ -0,0 +1,15 @@
+#!/bin/sh
+
+NR=0
+
+. ./testlib.sh
+
+echo 1..4
+
+t "dd if=/dev/urandom of=testfile.$$ bs=4k count=64 2>/dev/null && while ../cachestats -q testfile.$$; do ../cachedel testfile.$$ && sleep 1; done" "file is not cached"
+t "env LD_PRELOAD=../nocache.so sh -c 'exec 3<testfile.$$ 4<testfile.$$; cat <&3 >/dev/null; exec 4<&-; ../cachestats -q testfile.$$; r=\$?; exec 3<&-; exit \$r'" "closing one of two fds for a file keeps its pages"
+t "! ../cachestats -q testfile.$$" "closing the last one drops them"
+t "env NOCACHE_STATS=testfile.$$.json LD_PRELOAD=../nocache.so ../bench/openclose -n 4 testfile.$$ >/dev/null && grep -q '\"files_tracked\":5,' testfile.$$.json && grep -q '\"files_shared\":1,' testfile.$$.json" "a dup()ed fd shares the record of its file"
+
+# clean up
+rm -f testfile.$$ testfile.$$.json
@@ -0,0 +1,34 @@
+#!/bin/sh
+
+NR=0
+
+. ./testlib.sh
+
+echo 1..7
+
+t "dd if=/dev/zero of=testfile.$$ bs=1M count=4 2>/dev/null && sync testfile.$$ && ../cachestats -q testfile.$$" "file is cached"
+t "env NOCACHE_STATS=testfile.$$.json LD_PRELOAD=../nocache.so cat testfile.$$ >/dev/null && grep -q '\"files_tracked\":1,\"pages_cached_at_open\":1024,' testfile.$$.json && grep -q '\"store_pageinfo\":{\"calls\":1,' testfile.$$.json" "stats are written as JSON"
+t "../nocache -s cat testfile.$$ 2>&1 >/dev/null | grep -q 'files_tracked  *1$'" "nocache -s prints a summary"
+
+# cachestat() is in Linux 6.5 and later
+if uname -r | awk -F. '{ exit !($1 > 6 || ($1 == 6 && $2 >= 5)) }'; then
+    t "env NOCACHE_STATS=testfile.$$.json2 LD_PRELOAD=../nocache.so cat testfile.$$ >/dev/null && grep -q '\"mincore_calls\":0,\"cachestat_calls\":1,' testfile.$$.json2" "a fully cached file is found with a single cachestat call"
+else
+    echo "ok 4 # skip no cachestat before Linux 6.5"
+fi
+
+count() {
+    sed "s/.*\"$1\":\([0-9]*\).*/\1/" testfile.$$.json3
+}
+t "while ../cachestats -q testfile.$$; do ../cachedel testfile.$$ && sleep 1; done && env NOCACHE_NR_FADVISE=8 NOCACHE_STATS=testfile.$$.json3 LD_PRELOAD=../nocache.so cat testfile.$$ >/dev/null && [ \$(count evict_checks) -ge 1 ] && [ \$(count fadvise_calls) -lt 9 ] && [ \$(count pages_left_cached) -eq 0 ]" "fadvise is only repeated for pages left cached"
+
+t "cat testfile.$$ >/dev/null && ../cachedel -l 1M testfile.$$ && ../cachedel -o 2M testfile.$$ && rm -f testfile.$$.json3 && env NOCACHE_MAX_FADVISE=1 NOCACHE_STATS=testfile.$$.json3 LD_PRELOAD=../nocache.so cat testfile.$$ >/dev/null && [ \$(count pages_coalesced) -eq 256 ] && ../cachestats testfile.$$ | grep -q 'pages in cache: 0/'" "the cached pages between merged ranges are counted"
+
+# The first and the third MB stay mapped, so fadvise can't drop them:
+# besides the NOREUSE at open, there is the first DONTNEED and, with
+# NOCACHE_NR_FADVISE=4, three more passes that each check the range and
+# retry the two runs left, and a last check.
+t "while ../cachestats -q testfile.$$; do ../cachedel testfile.$$ && sleep 1; done && rm -f testfile.$$.json3 && env NOCACHE_NR_FADVISE=4 NOCACHE_STATS=testfile.$$.json3 LD_PRELOAD=../nocache.so ../bench/reread -m 0,1048576 -m 2097152,1048576 testfile.$$ >/dev/null && [ \$(count pages_left_cached) -eq 512 ] && [ \$(count fadvise_calls) -eq 8 ] && [ \$(count evict_checks) -eq 4 ]" "fadvise is repeated for each run of pages left cached"
+
+# clean up
+rm -f testfile.$$ testfile.$$.json testfile.$$.json2 testfile.$$.json3
@@ -0,0 +1,14 @@
+#!/bin/sh
+
+NR=0
+
+. ./testlib.sh
+
+echo 1..3
+
+t "echo test > testfile.$$ && ../cachestats -q testfile.$$" "file is cached"
+t "timeout 120 env LD_PRELOAD=../nocache.so ../bench/openclose -t 16 -n 2000 -r testfile.$$ >/dev/null" "concurrent open/close from many threads works"
+t "timeout 120 env NOCACHE_FLUSHALL=1 LD_PRELOAD=../nocache.so ../bench/openclose -t 16 -n 2000 -r testfile.$$ >/dev/null" "concurrent open/close with flushall works"
+
+# clean up
+rm -f testfile.$$
@@ -0,0 +1,14 @@
+#!/bin/sh
+
+NR=0
+
+. ./testlib.sh
+
+echo 1..3
+
+t "dd if=/dev/zero of=testfile.$$ bs=1M count=4 2>/dev/null && sync testfile.$$ && ../cachestats -q testfile.$$" "file is cached"
+t "env NOCACHE_TRACE=testfile.$$.trace LD_PRELOAD=../nocache.so cat testfile.$$ >/dev/null && ../tracedump -s testfile.$$.trace | grep -q 'pageinfo(fd=[0-9]*, offset=1024, len=1024)'" "trace records the pages found cached"
+t "timeout 120 env NOCACHE_TRACE=testfile.$$.trace LD_PRELOAD=../nocache.so ../bench/openclose -t 8 -n 1000 testfile.$$ >/dev/null && [ \$(../tracedump -c testfile.$$.trace | grep -c ',close,') -ge 8000 ]" "no events are lost with many threads"
+
+# clean up
+rm -f testfile.$$ testfile.$$.trace
@@ -0,0 +1,13 @@
+#!/bin/sh
+
+NR=0
+
+. ./testlib.sh
+
+echo 1..2
+
+t "env NOCACHE_WRITEBEHIND=256K NOCACHE_DEBUGFD=3 LD_PRELOAD=../nocache.so dd if=/dev/zero of=testfile.$$ bs=64k count=64 2>/dev/null 3>testfile.$$.log && grep -q 'write_behind(fd=' testfile.$$.log" "pages are written back while the file is being written"
+t "! ../cachestats -q testfile.$$" "file is not in cache"
+
+# clean up
+rm -f testfile.$$ testfile.$$.log
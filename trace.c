@@ -0,0 +1,150 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "trace.h"
+
+#define TRACE_BUF_EVENTS 1024
+
+struct trace_buf {
+    struct trace_buf *next;   /* list of all buffers, for trace_flush_all() */
+    int in_use;               /* owned by a live thread */
+    uint32_t tid;
+    int len;
+    struct trace_event ev[TRACE_BUF_EVENTS];
+};
+
+int trace_enabled;
+
+static int trace_fd = -1;
+static uint32_t trace_pid;
+static pthread_key_t trace_key;
+static struct trace_buf *trace_bufs;
+static __thread struct trace_buf *my_buf
+    __attribute__((tls_model("initial-exec")));
+
+static void flush(struct trace_buf *buf)
+{
+    ssize_t size = buf->len * sizeof(buf->ev[0]);
+
+    if(buf->len == 0)
+        return;
+    if(write(trace_fd, buf->ev, size) != size)
+        trace_enabled = 0;  /* don't keep failing */
+    buf->len = 0;
+}
+
+/* Called when a thread exits. Buffers are never freed, since
+ * trace_flush_all() may walk the list at any time; new threads reuse them
+ * instead. */
+static void thread_exit(void *arg)
+{
+    struct trace_buf *buf = arg;
+
+    flush(buf);
+    my_buf = NULL;
+    __atomic_store_n(&buf->in_use, 0, __ATOMIC_RELEASE);
+}
+
+void trace_init(const char *file)
+{
+    trace_fd = open(file, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if(trace_fd == -1) {
+        fprintf(stderr, "[nocache] can't open trace file %s\n", file);
+        return;
+    }
+    if(pthread_key_create(&trace_key, thread_exit) != 0)
+        return;
+    trace_pid = getpid();
+    trace_enabled = 1;
+}
+
+/* Called in the child after fork(): the events in the buffers are the
+ * parent's, which will write them itself. */
+void trace_reset(void)
+{
+    struct trace_buf *buf;
+
+    if(!trace_enabled)
+        return;
+    trace_pid = getpid();
+    for(buf = trace_bufs; buf; buf = buf->next) {
+        buf->len = 0;
+        buf->in_use = buf == my_buf;
+    }
+    if(my_buf != NULL)
+        my_buf->tid = syscall(SYS_gettid);
+}
+
+static struct trace_buf *new_buf(void)
+{
+    int in_use;
+    struct trace_buf *buf;
+
+    /* Take over the buffer of a thread that has exited, if there is one. */
+    for(buf = __atomic_load_n(&trace_bufs, __ATOMIC_ACQUIRE); buf;
+            buf = buf->next) {
+        in_use = 0;
+        if(__atomic_compare_exchange_n(&buf->in_use, &in_use, 1, false,
+                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            buf->tid = syscall(SYS_gettid);
+            pthread_setspecific(trace_key, buf);
+            return buf;
+        }
+    }
+
+    if((buf = calloc(1, sizeof(*buf))) == NULL)
+        return NULL;
+    buf->in_use = 1;
+    buf->tid = syscall(SYS_gettid);
+    buf->next = __atomic_load_n(&trace_bufs, __ATOMIC_RELAXED);
+    while(!__atomic_compare_exchange_n(&trace_bufs, &buf->next, buf, true,
+                __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+    pthread_setspecific(trace_key, buf);
+    return buf;
+}
+
+void trace_event(enum trace_type type, int fd, uint64_t offset, uint64_t len)
+{
+    struct timespec ts;
+    struct trace_event *ev;
+
+    if(my_buf == NULL && (my_buf = new_buf()) == NULL)
+        return;
+    if(my_buf->len == TRACE_BUF_EVENTS)
+        flush(my_buf);
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ev = &my_buf->ev[my_buf->len];
+    ev->ts = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    ev->offset = offset;
+    ev->len = len;
+    ev->fd = fd;
+    ev->type = type;
+    ev->pid = trace_pid;
+    ev->tid = my_buf->tid;
+    my_buf->len++;
+}
+
+/* At exit: write out what all threads have collected. Threads that are
+ * still running might add events concurrently; those may get lost. */
+void trace_flush_all(void)
+{
+    struct trace_buf *buf;
+
+    if(!trace_enabled)
+        return;
+    for(buf = __atomic_load_n(&trace_bufs, __ATOMIC_ACQUIRE); buf;
+            buf = buf->next)
+        flush(buf);
+}
+
+/* vim:set et sw=4 ts=4: */
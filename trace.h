@@ -0,0 +1,53 @@
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include <stdint.h>
+
+/* Binary event trace. Each thread collects events in a buffer of its own
+ * and appends it to the trace file with a single write() when it is full,
+ * when the thread exits and at program exit, so tracing takes no locks.
+ * The file is simply a sequence of struct trace_event records in host
+ * byte order; tracedump turns it back into text or CSV. */
+
+enum trace_type {
+    TRACE_OPEN = 1,       /* fd was opened (or dup'ed) and is tracked */
+    TRACE_IGNORE,         /* fd was opened, but the policy says ignore */
+    TRACE_PAGEINFO,       /* offset: pages cached at open, len: pages */
+    TRACE_CLOSE,          /* fd is being closed */
+    TRACE_SCAN,           /* [offset, offset+len) was checked with mincore */
+    TRACE_FADVISE,        /* [offset, offset+len) advised DONTNEED */
+    TRACE_COALESCE,       /* offset: ranges left, len: cached pages lost */
+    TRACE_DROP_BEHIND,    /* dropped [offset, len) behind the position */
+    TRACE_WRITE_BEHIND,   /* writeback started for [offset, len) */
+    TRACE_ASYNC_ENQUEUE,  /* close handed over to the worker */
+    TRACE_ASYNC_EVICT,    /* worker evicts fd (a duplicate) */
+    TRACE_CACHESTAT,      /* [offset, offset+len) was checked with cachestat */
+    TRACE_BUDGET,         /* [offset, offset+len) dropped to fit the budget */
+    TRACE_RESIDUAL,       /* len pages of the range at offset stayed cached */
+    NR_TRACE_TYPES
+};
+
+struct trace_event {
+    uint64_t ts;          /* CLOCK_MONOTONIC, in nanoseconds */
+    uint64_t offset;
+    uint64_t len;
+    int32_t fd;
+    uint32_t type;
+    uint32_t pid;
+    uint32_t tid;
+};
+
+extern int trace_enabled;
+
+void trace_init(const char *file);
+void trace_event(enum trace_type type, int fd, uint64_t offset, uint64_t len);
+void trace_reset(void);
+void trace_flush_all(void);
+
+#define TRACE(type, fd, offset, len) \
+    do { \
+        if(trace_enabled) \
+            trace_event(type, fd, offset, len); \
+    } while(0)
+
+#endif
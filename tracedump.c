@@ -0,0 +1,96 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+static const char *type_names[NR_TRACE_TYPES] = {
+    [TRACE_OPEN] = "open",
+    [TRACE_IGNORE] = "ignore",
+    [TRACE_PAGEINFO] = "pageinfo",
+    [TRACE_CLOSE] = "close",
+    [TRACE_SCAN] = "scan",
+    [TRACE_FADVISE] = "fadvise",
+    [TRACE_COALESCE] = "coalesce",
+    [TRACE_DROP_BEHIND] = "drop_behind",
+    [TRACE_WRITE_BEHIND] = "write_behind",
+    [TRACE_ASYNC_ENQUEUE] = "async_enqueue",
+    [TRACE_ASYNC_EVICT] = "async_evict",
+    [TRACE_CACHESTAT] = "cachestat",
+    [TRACE_BUDGET] = "budget",
+    [TRACE_RESIDUAL] = "residual",
+};
+
+static int cmp_ts(const void *a, const void *b)
+{
+    const struct trace_event *x = a, *y = b;
+    return x->ts < y->ts ? -1 : x->ts > y->ts;
+}
+
+int main(int argc, char *argv[])
+{
+    int opt, csv = 0, sort = 0;
+    size_t i, n;
+    FILE *fp;
+    struct stat st;
+    struct trace_event *ev;
+    const char *type;
+
+    while((opt = getopt(argc, argv, "cs")) != -1) {
+        switch(opt) {
+        case 'c': csv = 1; break;
+        case 's': sort = 1; break;
+        default: goto usage;
+        }
+    }
+    if(optind != argc - 1)
+        goto usage;
+
+    if((fp = fopen(argv[optind], "r")) == NULL || fstat(fileno(fp), &st) == -1) {
+        perror(argv[optind]);
+        return EXIT_FAILURE;
+    }
+    if(st.st_size % sizeof(*ev) != 0)
+        fprintf(stderr, "%s: trailing garbage ignored\n", argv[optind]);
+    n = st.st_size / sizeof(*ev);
+    if((ev = malloc(n * sizeof(*ev) + 1)) == NULL || fread(ev, sizeof(*ev), n, fp) != n) {
+        perror(argv[optind]);
+        return EXIT_FAILURE;
+    }
+    fclose(fp);
+
+    /* threads write their events in batches, so they are not in order */
+    if(sort)
+        qsort(ev, n, sizeof(*ev), cmp_ts);
+
+    if(csv)
+        printf("ts_ns,pid,tid,event,fd,offset,len\n");
+    for(i = 0; i < n; i++) {
+        type = ev[i].type < NR_TRACE_TYPES && type_names[ev[i].type] ?
+            type_names[ev[i].type] : "unknown";
+        if(csv)
+            printf("%llu,%u,%u,%s,%d,%llu,%llu\n",
+                (unsigned long long)ev[i].ts, ev[i].pid, ev[i].tid, type,
+                ev[i].fd, (unsigned long long)ev[i].offset,
+                (unsigned long long)ev[i].len);
+        else
+            printf("%llu.%09llu [%u/%u] %s(fd=%d, offset=%llu, len=%llu)\n",
+                (unsigned long long)ev[i].ts / 1000000000,
+                (unsigned long long)ev[i].ts % 1000000000,
+                ev[i].pid, ev[i].tid, type, ev[i].fd,
+                (unsigned long long)ev[i].offset,
+                (unsigned long long)ev[i].len);
+    }
+    return EXIT_SUCCESS;
+
+    usage:
+    fprintf(stderr, "usage: %s [-cs] <tracefile> "
+        "-- decode a trace written by nocache -t\n", argv[0]);
+    fprintf(stderr, "\t-c\tprint CSV\n\t-s\tsort events by time\n");
+    return EXIT_FAILURE;
+}
+
+/* vim:set et sw=4 ts=4: */
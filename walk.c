@@ -0,0 +1,190 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "walk.h"
+
+/* Files found by the walking thread wait in a bounded queue for the
+ * workers, so memory use does not depend on the size of the tree. */
+struct job {
+    char *path;
+    void *dir;
+};
+
+static const struct walk_ops *ops;
+static struct job *queue;
+static size_t queue_size, queue_head, queue_len;
+static int queue_done;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_nonempty = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t queue_nonfull = PTHREAD_COND_INITIALIZER;
+
+static int errors;
+
+static void walk_error(const char *path, int err)
+{
+    fprintf(stderr, "%s: %s\n", path, strerror(err));
+    __atomic_add_fetch(&errors, 1, __ATOMIC_RELAXED);
+}
+
+static void push(const char *path, void *dir)
+{
+    char *p;
+
+    if((p = strdup(path)) == NULL) {
+        walk_error(path, errno);
+        return;
+    }
+
+    pthread_mutex_lock(&queue_lock);
+    while(queue_len == queue_size)
+        pthread_cond_wait(&queue_nonfull, &queue_lock);
+    queue[(queue_head + queue_len++) % queue_size] = (struct job){ p, dir };
+    pthread_cond_signal(&queue_nonempty);
+    pthread_mutex_unlock(&queue_lock);
+}
+
+static void *worker(void *unused)
+{
+    struct job job;
+
+    for(;;) {
+        pthread_mutex_lock(&queue_lock);
+        while(queue_len == 0 && !queue_done)
+            pthread_cond_wait(&queue_nonempty, &queue_lock);
+        if(queue_len == 0) {
+            pthread_mutex_unlock(&queue_lock);
+            return NULL;
+        }
+        job = queue[queue_head];
+        queue_head = (queue_head + 1) % queue_size;
+        queue_len--;
+        pthread_cond_signal(&queue_nonfull);
+        pthread_mutex_unlock(&queue_lock);
+
+        if(ops->file(job.path, job.dir, ops->arg) == -1)
+            __atomic_add_fetch(&errors, 1, __ATOMIC_RELAXED);
+        free(job.path);
+    }
+}
+
+/* Walk the directory path, a buffer of size bytes that holds len
+ * characters. Entries are told apart by d_type where the file system
+ * provides it, so regular files are not stat()ed twice. */
+static void walk_dir(char **path, size_t *size, size_t len, void *parent)
+{
+    DIR *d;
+    struct dirent *de;
+    struct stat st;
+    size_t n;
+    void *dir;
+    char *p;
+
+    if((d = opendir(*path)) == NULL) {
+        walk_error(*path, errno);
+        return;
+    }
+    dir = ops->dir ? ops->dir(*path, parent, ops->arg) : NULL;
+
+    while((errno = 0, de = readdir(d)) != NULL) {
+        if(!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+            continue;
+
+        n = len + 1 + strlen(de->d_name);
+        if(n + 1 > *size) {
+            if((p = realloc(*path, 2 * n)) == NULL) {
+                walk_error(*path, errno);
+                break;
+            }
+            *path = p;
+            *size = 2 * n;
+        }
+        sprintf(*path + len, "%s%s", (*path)[len - 1] == '/' ? "" : "/",
+            de->d_name);
+
+        if(de->d_type == DT_UNKNOWN) {
+            if(lstat(*path, &st) == -1) {
+                walk_error(*path, errno);
+                continue;
+            }
+            de->d_type = S_ISDIR(st.st_mode) ? DT_DIR :
+                S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+        }
+        if(de->d_type == DT_DIR)
+            walk_dir(path, size, strlen(*path), dir);
+        else if(de->d_type == DT_REG)
+            push(*path, dir);
+        (*path)[len] = '\0';
+    }
+    if(errno)
+        walk_error(*path, errno);
+    closedir(d);
+}
+
+int walk_paths(char *const paths[], int nr_paths, int nr_threads,
+    const struct walk_ops *walk_ops)
+{
+    int i, n;
+    struct stat st;
+    pthread_t *threads;
+    char *path;
+    size_t size;
+
+    if(nr_threads <= 0 && (nr_threads = sysconf(_SC_NPROCESSORS_ONLN)) <= 0)
+        nr_threads = 1;
+
+    ops = walk_ops;
+    errors = 0;
+    queue_head = queue_len = queue_done = 0;
+    queue_size = 4 * nr_threads;
+    queue = malloc(queue_size * sizeof(*queue));
+    threads = malloc(nr_threads * sizeof(*threads));
+    if(!queue || !threads) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    for(n = 0; n < nr_threads; n++) {
+        if((errno = pthread_create(&threads[n], NULL, worker, NULL)) != 0) {
+            if(n > 0)
+                break;
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    for(i = 0; i < nr_paths; i++) {
+        if(stat(paths[i], &st) == -1)
+            walk_error(paths[i], errno);
+        else if(S_ISDIR(st.st_mode)) {
+            size = strlen(paths[i]) + 1;
+            if((path = strdup(paths[i])) == NULL)
+                walk_error(paths[i], errno);
+            else
+                walk_dir(&path, &size, size - 1, NULL);
+            free(path);
+        } else if(S_ISREG(st.st_mode))
+            push(paths[i], NULL);
+        else {
+            fprintf(stderr, "%s: not a regular file\n", paths[i]);
+            __atomic_add_fetch(&errors, 1, __ATOMIC_RELAXED);
+        }
+    }
+
+    pthread_mutex_lock(&queue_lock);
+    queue_done = 1;
+    pthread_cond_broadcast(&queue_nonempty);
+    pthread_mutex_unlock(&queue_lock);
+    while(n > 0)
+        pthread_join(threads[--n], NULL);
+
+    free(threads);
+    free(queue);
+    return errors;
+}
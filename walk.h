@@ -0,0 +1,24 @@
+#ifndef _WALK_H
+#define _WALK_H
+
+/* Parallel walk over files and directory trees for the command line tools.
+ * One thread walks the directories (without following symbolic links other
+ * than the paths given), while nr_threads workers process the regular files it finds. */
+
+struct walk_ops {
+    /* called from the walking thread for each directory with the value
+     * returned for its parent (NULL for the top), may be NULL itself */
+    void *(*dir)(const char *path, void *parent, void *arg);
+    /* called from a worker for each regular file with the value returned
+     * for its directory (NULL for files given as arguments); returns -1
+     * on errors, which it reports itself */
+    int (*file)(const char *path, void *dir, void *arg);
+    void *arg;
+};
+
+/* Walk paths, using all online CPUs if nr_threads is 0. Returns the number
+ * of errors. */
+int walk_paths(char *const paths[], int nr_paths, int nr_threads,
+    const struct walk_ops *ops);
+
+#endif